@@ -35,7 +35,6 @@
 
 #include <R_ext/GraphicsEngine.h>
 #include <R_ext/Rdynload.h>
-#include <R_ext/Riconv.h>
 
 #include <fstream>
 #include <set>
@@ -45,6 +44,10 @@
 
 #include "emf.h"  //defines EMF data structures
 #include "emf+.h" //defines EMF+ data structures
+#include "utf8.h" //UTF-8 decoding
+#include "resample.h" //raster downsampling
+#include "rectgrid.h" //detection of image()-style rectangle grids
+#include "pipeline.h" //drawing on a worker thread
 #include "fontmetrics.h" //platform-specific font metric code
 
 using namespace std;
@@ -53,10 +56,17 @@ using namespace std;
 class CDevEMF {
 public:
     CDevEMF(const char *defaultFontFamily, int coordDPI, bool customLty,
-            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed) :
+            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed,
+            bool compressRaster, bool rleRaster, double maxRasterDPI,
+            unsigned int rasterThreads, bool rasterizeRects, bool emz,
+            unsigned int emzThreads, bool asyncWrite, bool pipeline,
+            bool memoryMap, bool skipUnchanged, size_t bufferSize,
+            bool directIO, const char *templateFile, bool saveTemplate) :
         m_debug(false) {
         m_DefaultFontFamily = defaultFontFamily;
         m_PageNum = 0;
+        m_CurrTextCol = 0;
+        m_TemplateFresh = false;
         m_NumRecords = 0;
         m_CurrHadj = m_CurrPolyFill = -100;
         m_CurrClip[0] = m_CurrClip[1] = m_CurrClip[2] = m_CurrClip[3] = -1;
@@ -68,11 +78,30 @@ public:
         m_UseEMFPlusFont = emfpFont;
         m_UseEMFPlusRaster = emfpRaster;
         m_UseEMFPlusTextToPath = emfpEmbed;
+        m_CompressRaster = compressRaster;
+        m_RLERaster = rleRaster;
+        m_MaxRasterDPI = maxRasterDPI;
+        m_RasterThreads = rasterThreads;
+        m_RasterizeRects = rasterizeRects;
+        m_EMZ = emz;
+        m_EMZThreads = emzThreads;
+        m_AsyncWrite = asyncWrite;
+        m_MemoryMap = memoryMap;
+        m_SkipUnchanged = skipUnchanged;
+        m_BufferSize = bufferSize;
+        m_DirectIO = directIO;
+        m_TemplateFile = templateFile ? templateFile : "";
+        m_SaveTemplate = saveTemplate;
+        m_Worker = !pipeline ? NULL : new PIPELINE::CWorker
+            ([this](PIPELINE::SCommand &c) { x_Run(c); });
+    }
+    ~CDevEMF(void) {
+        delete m_Worker;
     }
 
     // Member-function R callbacks (see below class definition for
     // extern "C" versions
-    bool Open(const char* filename, int width, int height);
+    bool Open(const char* filename, int width, int height, SEXP memOut);
     void Close(void);
     void NewPage(const pGEcontext gc);
     void MetricInfo(int c, const pGEcontext gc, double* ascent,
@@ -86,6 +115,7 @@ public:
                   double hadj, const pGEcontext gc);
 
     void Rect(double x0, double y0, double x1, double y1, const pGEcontext gc);
+    void FlushRects(void);
     void Polygon(int n, double *x, double *y, const pGEcontext gc);
     void Path(double *x, double *y, int nPoly, int *nPts, bool winding,
               const pGEcontext gc);
@@ -93,6 +123,14 @@ public:
                 double width, double height, double rot,
                 Rboolean interpolate);
 
+    // With the pipeline option, shapes are drawn on a worker thread.
+    // Command() gives the command to fill in (and then Queue()) for a
+    // shape, or NULL if it must be drawn directly.  Anything else
+    // using the output must Sync() first.
+    PIPELINE::SCommand* Command(PIPELINE::EType type, const pGEcontext gc);
+    void Queue(void);
+    void Sync(void);
+
     // helper functions
     int Inches2Dev(double inches) { return m_CoordDPI*inches;}
     static double x_EffPointsize(const pGEcontext gc) {
@@ -100,31 +138,61 @@ public:
     }
 
 private:
-    static string iConvUTF8toUTF16LE(const string& s) {
-        void *cd = Riconv_open("UTF-16LE", "UTF-8");
-        if (cd == (void*)(-1)) {
-            Rf_error("EMF device failed to convert UTF-8 to UTF-16LE");
-            return "";
-        }
-        size_t inLeft = s.length();
-        size_t outLeft = s.length()*4;//overestimate
-        char *utf16 = new char[outLeft];
-        const char *in = s.c_str();
-        char *out = utf16;
-        size_t res = Riconv(cd, &in, &inLeft, &out, &outLeft);
-        if (res != 0) {
-            delete[] utf16;
+    void x_Run(PIPELINE::SCommand &c);
+    static bool x_IsPagePattern(const char *filename);
+    string x_PageFilename(int pageNum) const;
+    bool x_BeginFile(const char *filename);
+    void x_EndFile(bool background);
+    static unsigned int x_UInt4(const unsigned char *p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+    }
+    static bool x_StoredHash(const string &filename, HASH::TUInt8 &hash);
+    unsigned int x_TemplateSettings(void) const;
+    bool x_LoadTemplate(void);
+    bool x_SaveTemplate(void);
+    static void x_UTF8toUTF16LE(const string &s, string &out) {
+        if (!UTF8::AppendUTF16LE(out, s.data(), s.length())) {
             Rf_error("Text string not valid UTF-8.");
-            return "";
         }
-        string ret(utf16, s.length()*4 - outLeft);
-        delete[] utf16;
-        Riconv_close(cd);
-        return ret;
+    }
+    // devEMF version; found using R "packageVersion" function on first
+    // use and then kept for the rest of the session (unless that
+    // fails, in which case "?" is returned and it is tried again next
+    // time)
+    static const string& x_PackageVersion(void) {
+        static string ver;
+        static const string unknown("?");
+        if (!ver.empty()) {
+            return ver;
+        }
+        SEXP packageVer, call, res;
+        int err = 0;
+        PROTECT(packageVer = Rf_findFun(Rf_install("packageVersion"),
+                                        R_GlobalEnv));
+        PROTECT(call = Rf_lang2(packageVer, Rf_ScalarString
+                                (Rf_mkChar("devEMF"))));
+        PROTECT(res = R_tryEvalSilent(call, R_GlobalEnv, &err));
+        if (!err  &&  Rf_isVector(res)  &&  Rf_length(res) == 1  &&
+            Rf_isInteger(VECTOR_ELT(res,0))  &&
+            Rf_length(VECTOR_ELT(res,0)) >= 1) {
+            std::ostringstream oss;
+            oss << INTEGER(VECTOR_ELT(res,0))[0];
+            if (Rf_length(VECTOR_ELT(res,0)) >= 2) {
+                oss << "." << INTEGER(VECTOR_ELT(res,0))[1];
+                if (Rf_length(VECTOR_ELT(res,0)) >= 3) {
+                    oss << "." << INTEGER(VECTOR_ELT(res,0))[2];
+                }
+            }
+            ver = oss.str();
+        }
+        UNPROTECT(3);
+        return ver.empty() ? unknown : ver;
     }
     void x_TransformY(double* y, int n) {
         for (int i = 0; i < n;  ++i, ++y) *y = m_Height - *y;
     }
+    void x_Rect(double x0, double y0, double x1, double y1,
+                const pGEcontext gc);
 
     unsigned char x_GetPen(const pGEcontext gc) {
         return m_UseEMFPlus ?
@@ -221,15 +289,34 @@ private:
         if (info == NULL) {
             info = x_GetFontInfo(gc);
         }
-        return m_UseEMFPlus  &&  m_UseEMFPlusFont ?
-            m_ObjectTable.GetFont(info->m_Spec.m_Face,
-                                  info->m_Spec.m_Size,
-                                  iConvUTF8toUTF16LE(info->m_Spec.m_Family),
-                                  m_File) :
-            m_ObjectTableEMF.GetFont(info->m_Spec.m_Face,
-                                     info->m_Spec.m_Size,
-                                     iConvUTF8toUTF16LE(info->m_Spec.m_Family),
-                                     rot, m_File);
+        SSysFontInfo::SObjectCache &cache = info->m_ObjCache;
+        if (cache.familyUTF16.empty()) {
+            x_UTF8toUTF16LE(info->m_Spec.m_Family, cache.familyUTF16);
+        }
+        if (m_UseEMFPlus  &&  m_UseEMFPlusFont) {
+            if (cache.emfPlusId < 0  ||
+                !m_ObjectTable.HasObject(cache.emfPlusId,
+                                         cache.emfPlusSerial)) {
+                cache.emfPlusId =
+                    m_ObjectTable.GetFont(info->m_Spec.m_Face,
+                                          info->m_Spec.m_Size,
+                                          cache.familyUTF16, m_File);
+                cache.emfPlusSerial =
+                    m_ObjectTable.GetSerial(cache.emfPlusId);
+            }
+            return cache.emfPlusId;
+        }
+        if (cache.emfId >= 0  &&  cache.emfRot == rot) {
+            m_ObjectTableEMF.SelectObject(EMF::eEMR_EXTCREATEFONTINDIRECTW,
+                                          cache.emfId, m_File);
+        } else {
+            cache.emfId = m_ObjectTableEMF.GetFont(info->m_Spec.m_Face,
+                                                   info->m_Spec.m_Size,
+                                                   cache.familyUTF16,
+                                                   rot, m_File);
+            cache.emfRot = rot;
+        }
+        return cache.emfId;
     }
     void x_SetEMFTextColor(int col) {
         EMF::S_SETTEXTCOLOR emr;
@@ -247,6 +334,8 @@ private:
 private:
     bool m_debug;
     EMF::ofstream m_File;
+    SEXP m_MemOut; //environment receiving in-memory output (if no file)
+    string m_FilePattern; //e.g. "Rplot%03d.emf" for a file per page
     int m_NumRecords;
     int m_PageNum;
     int m_Width, m_Height;
@@ -257,6 +346,45 @@ private:
     bool m_UseEMFPlusFont;
     bool m_UseEMFPlusRaster;
     bool m_UseEMFPlusTextToPath;
+    bool m_CompressRaster;
+    bool m_RLERaster; //run-length encode EMF palette bitmaps
+    double m_MaxRasterDPI; //downsample rasters beyond this (if finite)
+    unsigned int m_RasterThreads; //for raster processing (0 = all cores)
+    bool m_RasterizeRects;
+    bool m_EMZ; //gzip compress the output
+    unsigned int m_EMZThreads; //for compressing it (0 = all cores)
+    bool m_AsyncWrite; //write the output from a background thread
+    bool m_MemoryMap; //write an output file through a memory mapping
+    size_t m_BufferSize; //for writing output files (0 = library default)
+    bool m_DirectIO; //write output files bypassing the page cache
+
+    // A template holds the records (after the EMF header) drawn by a
+    // device, and the state needed to carry on drawing after them.
+    // Devices started from a template copy in its records rather than
+    // drawing the same background again.
+    struct STemplate {
+        unsigned int nRecords;
+        unsigned int nEMFObjects; //created by the records
+        unsigned int emfPlusLast; //slot of the last EMF+ object
+        int textCol;
+        string records;
+    };
+    string m_TemplateFile; //saved when closing, or loaded when opening
+    bool m_SaveTemplate;
+    STemplate m_Template; //(loaded, if records not empty)
+    bool m_TemplateFresh; //copied in since the last page began
+    std::streampos m_BodyStart; //of the records after the EMF header
+    bool m_SkipUnchanged; //leave files with the same content hash alone
+    string m_Target; //file replaced when closing (with m_SkipUnchanged)
+    unsigned int m_HashOffset; //of the hash digits in the EMF header
+    vector<string> m_Hashes; //content hash of each file (as hex)
+    vector<bool> m_Unchanged; //whether each file was left alone
+    PIPELINE::CWorker *m_Worker; //drawing shapes (if pipelined)
+    PIPELINE::SCommand m_Command; //being filled in by a callback
+
+    //borderless rectangles possibly tiling a grid, not yet drawn
+    CRectGrid m_RectGrid;
+    R_GE_gcontext m_RectGridGC;
 
     //EMF states
     double m_CurrHadj;
@@ -272,6 +400,14 @@ private:
     CFontInfoIndex m_FontInfoIndex;
 };
 
+void EMF::Warning(const char *msg) {
+    if (PIPELINE::CWorker *worker = PIPELINE::CWorker::Current()) {
+        worker->Warn(msg); //passed on to R by CDevEMF::Sync/Queue
+    } else {
+        Rf_warning("%s", msg);
+    }
+}
+
 // R callbacks below (declare extern "C")
 namespace EMFcb {
     extern "C" {
@@ -282,8 +418,17 @@ namespace EMFcb {
         void Raster(unsigned int* r, int w, int h, double x, double y,
                     double width, double height, double rot,
                     Rboolean interpolate, const pGEcontext, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->
-                Raster(r,w,h,x,y,width,height,rot,interpolate);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::eRaster, NULL)) {
+                c->pixels.assign(r, r + (size_t)w*h);
+                c->i[0] = w; c->i[1] = h; c->i[2] = interpolate;
+                c->v[0] = x; c->v[1] = y; c->v[2] = width; c->v[3] = height;
+                c->v[4] = rot;
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Raster(r,w,h,x,y,width,height,rot,interpolate);
         }
         SEXP Cap(pDevDesc) {
             Rf_warning("Raster capture not available for EMF");
@@ -291,13 +436,30 @@ namespace EMFcb {
         }
         void Path(double* x, double* y, int n, int* np, Rboolean wnd,
                   const pGEcontext gc, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Path(x,y, n,np, wnd, gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::ePath, gc)) {
+                c->n.assign(np, np + n);
+                int nPts = 0;
+                for (int i = 0;  i < n;  ++i) {
+                    nPts += np[i];
+                }
+                c->Points(nPts, x, y);
+                c->i[0] = wnd;
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Path(x,y, n,np, wnd, gc);
         }
         void Close(pDevDesc dd) {
+            static_cast<CDevEMF*>(dd->deviceSpecific)->Sync();
+            static_cast<CDevEMF*>(dd->deviceSpecific)->FlushRects();
             static_cast<CDevEMF*>(dd->deviceSpecific)->Close();
             delete static_cast<CDevEMF*>(dd->deviceSpecific);
         }
         void NewPage(const pGEcontext gc, pDevDesc dd) {
+            static_cast<CDevEMF*>(dd->deviceSpecific)->Sync();
+            static_cast<CDevEMF*>(dd->deviceSpecific)->FlushRects();
             static_cast<CDevEMF*>(dd->deviceSpecific)->NewPage(gc);
         }
         void MetricInfo(int c, const pGEcontext gc, double* ascent,
@@ -309,22 +471,52 @@ namespace EMFcb {
             return static_cast<CDevEMF*>(dd->deviceSpecific)->StrWidth(str, gc);
         }
         void Clip(double x0, double x1, double y0, double y1, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Clip(x0,x1,y0,y1);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::eClip, NULL)) {
+                c->v[0] = x0; c->v[1] = x1; c->v[2] = y0; c->v[3] = y1;
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Clip(x0,x1,y0,y1);
         }
         void Circle(double x, double y, double r, const pGEcontext gc,
                     pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Circle(x,y,r,gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::eCircle, gc)) {
+                c->v[0] = x; c->v[1] = y; c->v[2] = r;
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Circle(x,y,r,gc);
         }
         void Line(double x1, double y1, double x2, double y2,
                   const pGEcontext gc, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Line(x1,y1,x2,y2,gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::eLine, gc)) {
+                c->v[0] = x1; c->v[1] = y1; c->v[2] = x2; c->v[3] = y2;
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Line(x1,y1,x2,y2,gc);
         }
         void Polyline(int n, double *x, double *y, 
                       const pGEcontext gc, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Polyline(n,x,y, gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::ePolyline, gc)) {
+                c->Points(n, x, y);
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Polyline(n,x,y, gc);
         }
         void TextUTF8(double x, double y, const char *str, double rot,
                       double hadj, const pGEcontext gc, pDevDesc dd) {
+            static_cast<CDevEMF*>(dd->deviceSpecific)->Sync();
+            static_cast<CDevEMF*>(dd->deviceSpecific)->FlushRects();
             static_cast<CDevEMF*>(dd->deviceSpecific)->
                 TextUTF8(x,y,str,rot,hadj,gc);
         }
@@ -334,11 +526,24 @@ namespace EMFcb {
         }
         void Rect(double x0, double y0, double x1, double y1,
                   const pGEcontext gc, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Rect(x0,y0,x1,y1,gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::eRect, gc)) {
+                c->v[0] = x0; c->v[1] = y0; c->v[2] = x1; c->v[3] = y1;
+                emf->Queue();
+                return;
+            }
+            emf->Rect(x0,y0,x1,y1,gc);
         }
         void Polygon(int n, double *x, double *y, 
                      const pGEcontext gc, pDevDesc dd) {
-            static_cast<CDevEMF*>(dd->deviceSpecific)->Polygon(n,x,y,gc);
+            CDevEMF *emf = static_cast<CDevEMF*>(dd->deviceSpecific);
+            if (PIPELINE::SCommand *c = emf->Command(PIPELINE::ePolygon, gc)) {
+                c->Points(n, x, y);
+                emf->Queue();
+                return;
+            }
+            emf->FlushRects();
+            emf->Polygon(n,x,y,gc);
         }
 
         void Size(double *left, double *right, double *bottom, double *top,
@@ -403,18 +608,185 @@ double CDevEMF::StrWidth(const char *str, const pGEcontext gc) {
     return width;
 }
 
+
+PIPELINE::SCommand* CDevEMF::Command(PIPELINE::EType type,
+                                     const pGEcontext gc) {
+    if (!m_Worker) {
+        return NULL;
+    }
+#if R_GE_version >= 13
+    if (gc  &&  gc->patternFill != R_NilValue) {
+        Sync(); //patterns are R objects, only usable on the R thread
+        return NULL;
+    }
+#endif
+    m_Command.type = type;
+    if (gc) {
+        m_Command.gc.Set(gc);
+    } else {
+        m_Command.gc = PIPELINE::SGC();
+    }
+    return &m_Command;
+}
+
+void CDevEMF::Queue(void) {
+    m_Worker->Push(m_Command);
+    m_Command = PIPELINE::SCommand();
+    vector<string> warnings = m_Worker->TakeWarnings();
+    for (unsigned int i = 0;  i < warnings.size();  ++i) {
+        Rf_warning("%s", warnings[i].c_str());
+    }
+}
+
+void CDevEMF::Sync(void) {
+    if (!m_Worker) {
+        return;
+    }
+    m_Worker->Drain();
+    vector<string> warnings = m_Worker->TakeWarnings();
+    for (unsigned int i = 0;  i < warnings.size();  ++i) {
+        Rf_warning("%s", warnings[i].c_str());
+    }
+}
+
+// Draw a queued shape (on the worker thread)
+void CDevEMF::x_Run(PIPELINE::SCommand &c) {
+    R_GE_gcontext gc;
+    c.gc.Get(gc);
+    if (c.type != PIPELINE::eRect) {
+        FlushRects();
+    }
+    switch (c.type) {
+    case PIPELINE::eLine:
+        Line(c.v[0], c.v[1], c.v[2], c.v[3], &gc);
+        break;
+    case PIPELINE::ePolyline:
+        Polyline(c.x.size(), c.x.data(), c.y.data(), &gc);
+        break;
+    case PIPELINE::ePolygon:
+        Polygon(c.x.size(), c.x.data(), c.y.data(), &gc);
+        break;
+    case PIPELINE::ePath:
+        Path(c.x.data(), c.y.data(), c.n.size(), c.n.data(), c.i[0], &gc);
+        break;
+    case PIPELINE::eRect:
+        Rect(c.v[0], c.v[1], c.v[2], c.v[3], &gc);
+        break;
+    case PIPELINE::eCircle:
+        Circle(c.v[0], c.v[1], c.v[2], &gc);
+        break;
+    case PIPELINE::eRaster:
+        Raster(c.pixels.data(), c.i[0], c.i[1], c.v[0], c.v[1], c.v[2],
+               c.v[3], c.v[4], (Rboolean) c.i[2]);
+        break;
+    case PIPELINE::eClip:
+        Clip(c.v[0], c.v[1], c.v[2], c.v[3]);
+        break;
+    }
+}
+
 	/* Initialize the device */
 
-bool CDevEMF::Open(const char* filename, int width, int height)
+bool CDevEMF::Open(const char* filename, int width, int height, SEXP memOut)
 {
     if (m_debug) Rprintf("open: %i, %i\n", width, height);
     m_Width = width;
     m_Height = height;
     
-    m_File.open(R_ExpandFileName(filename), ios_base::binary);
+    // without a filename, output is kept in memory and handed to R
+    // (as "data" in environment memOut) when closing
+    if (m_SaveTemplate) {
+        // the records are kept in memory and saved when closing
+        m_TemplateFile = R_ExpandFileName(filename);
+        filename = NULL;
+    } else if (!m_TemplateFile.empty()  &&  !x_LoadTemplate()) {
+        return FALSE;
+    }
+    if (filename) {
+        filename = R_ExpandFileName(filename);
+        if (filename[0] != '|'  &&  x_IsPagePattern(filename)) {
+            m_FilePattern = filename;
+        }
+    }
+    if (!x_BeginFile(m_FilePattern.empty() ? filename :
+                     x_PageFilename(1).c_str())) {
+        return FALSE;
+    }
+    m_MemOut = memOut;
+    R_PreserveObject(m_MemOut);
+    return TRUE;
+}
+
+// Whether filename is a pattern giving a file per page (as for other
+// R devices), i.e. has a single integer conversion such as "%03d"
+bool CDevEMF::x_IsPagePattern(const char *filename) {
+    int nConversions = 0;
+    for (const char *p = filename;  *p;  ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        if (*++p == '%') {
+            continue; //literal '%'
+        }
+        p += strspn(p, "#0- +");
+        p += strspn(p, "0123456789");
+        if (*p != 'd'  &&  *p != 'i') {
+            return false;
+        }
+        ++nConversions;
+    }
+    return nConversions == 1;
+}
+
+string CDevEMF::x_PageFilename(int pageNum) const {
+    int n = snprintf(NULL, 0, m_FilePattern.c_str(), pageNum);
+    string filename(n > 0 ? n : 0, '\0');
+    if (n > 0) {
+        snprintf(&filename[0], n+1, m_FilePattern.c_str(), pageNum);
+    }
+    return filename;
+}
+
+// Open an output file (or memory if filename is NULL) and write the
+// records starting it.  Object tables and cached object ids are reset,
+// so this can start each page of a file series.
+bool CDevEMF::x_BeginFile(const char* filename)
+{
+    // with skipUnchanged, a file is written under a temporary name and
+    // only replaces the target if their content hashes differ
+    m_Target.clear();
+    if (m_SkipUnchanged  &&  filename  &&  filename[0] != '|') {
+        m_Target = filename;
+    }
+    m_File.open(m_Target.empty() ? filename : (m_Target + ".tmp").c_str(),
+                ios_base::binary, m_MemoryMap, m_BufferSize, m_DirectIO);
     if (!m_File) {
 	return FALSE;
     }
+    if (m_AsyncWrite  &&  !m_SaveTemplate) {
+        m_File.Async();
+    }
+#ifdef HAVE_ZLIB
+    if (m_EMZ  &&  !m_SaveTemplate) {
+        m_File.Deflate(m_EMZThreads);
+    }
+#endif
+    if (m_SkipUnchanged  &&  !m_SaveTemplate) {
+        // the header is not hashed, but the plot size it gives (and
+        // whether the file is compressed) are
+        string settings;
+        settings << EMF::TUInt4(m_Width) << EMF::TUInt4(m_Height)
+                 << EMF::TUInt4(m_CoordDPI) << EMF::TUInt4(m_EMZ);
+        m_File.Hash(HASH::Hash64(settings.data(), settings.size()));
+    }
+    m_ObjectTable.Clear();
+    m_ObjectTableEMF.Clear();
+    for (CFontInfoIndex::iterator i = m_FontInfoIndex.begin();
+         i != m_FontInfoIndex.end();  ++i) {
+        i->second->m_ObjCache.emfId = -1; //EMF+ ids are checked by serial
+    }
+    m_CurrHadj = m_CurrPolyFill = -100;
+    m_CurrClip[0] = m_CurrClip[1] = m_CurrClip[2] = m_CurrClip[3] = -1;
 
     {
         EMF::SHeader emr;
@@ -428,31 +800,16 @@ bool CDevEMF::Open(const char* filename, int width, int height)
         emr.nRecords = 0; //WILL EDIT WHEN CLOSING
         emr.nHandles = 0; //WILL EDIT WHEN CLOSING
         emr.reserved = 0x0000;
-        string ver = "?"; // devEMF version
-        {//find version using R "packageVersion" function
-            SEXP packageVer, call, res;
-            PROTECT(packageVer = Rf_findFun(Rf_install("packageVersion"),
-                                            R_GlobalEnv));
-            PROTECT(call = Rf_lang2(packageVer, Rf_ScalarString
-                                    (Rf_mkChar("devEMF"))));
-            PROTECT(res = Rf_eval(call, R_GlobalEnv));
-            if (Rf_isVector(res)  &&  Rf_length(res) == 1  &&
-                Rf_isInteger(VECTOR_ELT(res,0))  &&
-                Rf_length(VECTOR_ELT(res,0)) >= 1) {
-                std::ostringstream oss;
-                oss << INTEGER(VECTOR_ELT(res,0))[0];
-                if (Rf_length(VECTOR_ELT(res,0)) >= 2) {
-                    oss << "." << INTEGER(VECTOR_ELT(res,0))[1];
-                    if (Rf_length(VECTOR_ELT(res,0)) >= 3) {
-                        oss << "." << INTEGER(VECTOR_ELT(res,0))[2];
-                    }
-                }
-                ver = oss.str();
-            }
-            UNPROTECT(3);
-        }
         //Description string must be UTF-16LE
-        emr.desc = iConvUTF8toUTF16LE("Created by R using devEMF ver. "+ver);
+        x_UTF8toUTF16LE("Created by R using devEMF ver. " + x_PackageVersion(),
+                        emr.desc);
+        if (m_SkipUnchanged) {
+            // picture name giving the content hash (filled in when
+            // closing), which is compared to that of the next version
+            x_UTF8toUTF16LE(string("\0devEMF hash ", 13), emr.desc);
+            m_HashOffset = 108 + emr.desc.length(); //desc follows header
+            x_UTF8toUTF16LE(string(16, '0') + string(2, '\0'), emr.desc);
+        }
         emr.nDescription = emr.desc.length()/2;
         emr.offDescription = 0; //set during serialization
         emr.nPalEntries = 0;
@@ -465,6 +822,20 @@ bool CDevEMF::Open(const char* filename, int width, int height)
         emr.micrometers.Set(m_Width * (25400./Inches2Dev(1)),
                             m_Height * (25400./Inches2Dev(1)));
         emr.Write(m_File);
+        m_File.EndHeader(); //rest may be compressed as it is written
+    }
+    m_BodyStart = m_File.tellp();
+
+    if (!m_Template.records.empty()) {
+        // the template's records start the plot (including the setup
+        // below), and the tables carry on from its objects
+        m_File.write(m_Template.records.data(), m_Template.records.size());
+        m_File.nRecords += m_Template.nRecords;
+        m_ObjectTableEMF.Continue(m_Template.nEMFObjects);
+        m_ObjectTable.Continue(m_Template.emfPlusLast);
+        m_CurrTextCol = m_Template.textCol;
+        m_TemplateFresh = true;
+        return TRUE;
     }
 
     if (m_UseEMFPlus) {
@@ -516,9 +887,20 @@ bool CDevEMF::Open(const char* filename, int width, int height)
 
 void CDevEMF::NewPage(const pGEcontext gc) {
     if (++m_PageNum > 1) {
-        Rf_warning("Multiple pages not available for EMF device");
+        if (m_FilePattern.empty()) {
+            Rf_warning("Multiple pages not available for EMF device");
+        } else {
+            // the finished page is closed off while drawing the next
+            x_EndFile(true);
+            string filename = x_PageFilename(m_PageNum);
+            if (!x_BeginFile(filename.c_str())) {
+                Rf_error("unable to open file '%s'", filename.c_str());
+            }
+        }
     }
-    if (R_OPAQUE(gc->fill)) {
+    if (m_TemplateFresh) {
+        m_TemplateFresh = false; //background is part of the template
+    } else if (R_OPAQUE(gc->fill)) {
 	gc->col = R_TRANWHITE; // no line around border
         Rect(0, 0, m_Width, m_Height, gc);
     }
@@ -561,6 +943,184 @@ void CDevEMF::Close(void)
 {
     if (m_debug) Rprintf("close\n");
 
+    if (m_SaveTemplate) {
+        if (!x_SaveTemplate()) {
+            Rf_warning("devEMF: error writing output");
+        }
+        R_ReleaseObject(m_MemOut);
+        return;
+    }
+    x_EndFile(false);
+    if (!m_File) {
+        Rf_warning("devEMF: error writing output");
+    }
+
+    if (m_File.InMemory()) {
+        const vector<char> &mem = m_File.MemoryData();
+        SEXP raw = PROTECT(Rf_allocVector(RAWSXP, mem.size()));
+        memcpy(RAW(raw), &mem[0], mem.size());
+        m_File.ClearMemory();
+        Rf_defineVar(Rf_install("data"), raw, m_MemOut);
+        UNPROTECT(1);
+    }
+    if (m_SkipUnchanged) {
+        SEXP hashes = PROTECT(Rf_allocVector(STRSXP, m_Hashes.size()));
+        SEXP unchanged = PROTECT(Rf_allocVector(LGLSXP, m_Unchanged.size()));
+        for (unsigned int i = 0;  i < m_Hashes.size();  ++i) {
+            SET_STRING_ELT(hashes, i, Rf_mkChar(m_Hashes[i].c_str()));
+            LOGICAL(unchanged)[i] = m_Unchanged[i];
+        }
+        Rf_defineVar(Rf_install("hash"), hashes, m_MemOut);
+        Rf_defineVar(Rf_install("unchanged"), unchanged, m_MemOut);
+        UNPROTECT(2);
+    }
+    R_ReleaseObject(m_MemOut);
+}
+
+// Content hash recorded in the header of an EMF (or EMZ, as written
+// by this device) file written with skipUnchanged
+bool CDevEMF::x_StoredHash(const string &filename, HASH::TUInt8 &hash)
+{
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    unsigned char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    const unsigned char *p = buf;
+    if (n >= 15  &&  p[0] == 0x1F  &&  p[1] == 0x8B) {
+        // EMZ: the header is the start of a stored deflate block
+        // following the (flagless) gzip header
+        if (p[3] != 0  ||  p[10] != 0) {
+            return false;
+        }
+        p += 15;
+        n -= 15;
+    }
+    if (n < 108  ||  x_UInt4(p) != EMF::eEMR_HEADER) {
+        return false;
+    }
+    size_t end = std::min((size_t)x_UInt4(p+64) + 2*(size_t)x_UInt4(p+60), n);
+    string desc; //(ASCII part of the) UTF-16LE description
+    for (size_t i = x_UInt4(p+64);  i + 1 < end;  i += 2) {
+        desc += p[i+1] ? '?' : p[i];
+    }
+    const string kTag("\0devEMF hash ", 13);
+    size_t pos = desc.find(kTag);
+    if (pos == string::npos  ||  desc.size() < pos + kTag.size() + 16) {
+        return false;
+    }
+    string hex = desc.substr(pos + kTag.size(), 16);
+    if (hex.find_first_not_of("0123456789abcdef") != string::npos) {
+        return false;
+    }
+    hash = strtoull(hex.c_str(), NULL, 16);
+    return true;
+}
+
+// Device settings a template must have been saved with to be used
+unsigned int CDevEMF::x_TemplateSettings(void) const
+{
+    return m_UseEMFPlus | m_UseEMFPlusFont << 1 | m_UseEMFPlusRaster << 2 |
+        m_UseEMFPlusTextToPath << 3 | m_UseCustomLty << 4;
+}
+
+// Template file: the magic number, then kTemplateFields 4-byte
+// integers (size and settings of the device, the template's state and
+// the length of its records) and the records
+static const char kTemplateMagic[] = "DEVEMFT1";
+enum { kTemplateFields = 9 };
+
+bool CDevEMF::x_LoadTemplate(void)
+{
+    string filename = R_ExpandFileName(m_TemplateFile.c_str());
+    std::ifstream in(filename.c_str(), ios_base::binary);
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    string data = oss.str();
+    const size_t kStart = 8 + 4*kTemplateFields;
+    if (data.size() < kStart  ||  data.compare(0, 8, kTemplateMagic) != 0) {
+        Rf_warning("'%s' is not a devEMF template", filename.c_str());
+        return false;
+    }
+    unsigned int v[kTemplateFields];
+    for (unsigned int i = 0;  i < kTemplateFields;  ++i) {
+        v[i] = x_UInt4(reinterpret_cast<const unsigned char*>(&data[8+4*i]));
+    }
+    // name the emf() argument that differs, so it can be fixed
+    if (v[2] != (unsigned int) m_CoordDPI) {
+        Rf_warning("template '%s' was saved with coordDPI = %u, but this "
+                   "device has coordDPI = %d", filename.c_str(), v[2],
+                   m_CoordDPI);
+        return false;
+    }
+    if (v[0] != (unsigned int) m_Width  ||  v[1] != (unsigned int) m_Height) {
+        Rf_warning("template '%s' was saved with width = %g, height = %g "
+                   "(inches), but this device has width = %g, height = %g",
+                   filename.c_str(), double(v[0])/v[2], double(v[1])/v[2],
+                   double(m_Width)/m_CoordDPI, double(m_Height)/m_CoordDPI);
+        return false;
+    }
+    //in the order of the bits of x_TemplateSettings()
+    static const char* const kSettingNames[] = {
+        "emfPlus", "emfPlusFont", "emfPlusRaster", "emfPlusFontToPath",
+        "custom.lty"
+    };
+    unsigned int settings = x_TemplateSettings();
+    for (unsigned int i = 0;  i < sizeof(kSettingNames)/sizeof(char*);  ++i) {
+        bool saved = (v[3] >> i) & 1, current = (settings >> i) & 1;
+        if (saved != current) {
+            Rf_warning("template '%s' was saved with %s = %s, but this "
+                       "device has %s = %s", filename.c_str(),
+                       kSettingNames[i], saved ? "TRUE" : "FALSE",
+                       kSettingNames[i], current ? "TRUE" : "FALSE");
+            return false;
+        }
+    }
+    if (data.size() - kStart != v[8]) {
+        Rf_warning("template '%s' is truncated", filename.c_str());
+        return false;
+    }
+    m_Template.nRecords = v[4];
+    m_Template.nEMFObjects = v[5];
+    m_Template.emfPlusLast = v[6];
+    m_Template.textCol = v[7];
+    m_Template.records = data.substr(kStart);
+    return true;
+}
+
+bool CDevEMF::x_SaveTemplate(void)
+{
+    if (m_File.inEMFplus) {
+        EMFPLUS::GetDC(m_File); //as before any EMF record
+        m_File.inEMFplus = false;
+    }
+    m_File.close();
+    const vector<char> &mem = m_File.MemoryData();
+    size_t start = m_BodyStart;
+    string data(kTemplateMagic, 8);
+    data << EMF::TUInt4(m_Width) << EMF::TUInt4(m_Height)
+         << EMF::TUInt4(m_CoordDPI) << EMF::TUInt4(x_TemplateSettings())
+         << EMF::TUInt4(m_File.nRecords - 1) //all but the header
+         << EMF::TUInt4(m_ObjectTableEMF.GetSize())
+         << EMF::TUInt4(m_ObjectTable.GetLast())
+         << EMF::TUInt4(m_CurrTextCol)
+         << EMF::TUInt4(mem.size() - start);
+    data.append(mem.begin() + start, mem.end());
+    FILE *f = fopen(m_TemplateFile.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size()  &&  !!m_File;
+    return fclose(f) == 0  &&  ok;
+}
+
+// Write the records ending the current file, patch its header and
+// close it (or have it closed off in the background, while another
+// file is started)
+void CDevEMF::x_EndFile(bool background)
+{
     if (m_UseEMFPlus) {
         EMFPLUS::SEndOfFile empr;
         empr.Write(m_File);
@@ -584,6 +1144,27 @@ void CDevEMF::Close(void)
             //not mentioned in spec, but seems to need one extra handle
              << EMF::TUInt4(m_ObjectTableEMF.GetSize()+1);
         m_File.write(data.data(), 12);
+    }
+    // (not hashing if this file could not be opened)
+    if (m_SkipUnchanged  &&  m_File  &&  m_File.Hashing()) {
+        HASH::TUInt8 hash = m_File.ContentHash(), stored;
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", hash);
+        string digits;
+        x_UTF8toUTF16LE(hex, digits);
+        m_File.seekp(m_HashOffset);
+        m_File.write(digits.data(), digits.size());
+        bool unchanged = !m_Target.empty()  &&
+            x_StoredHash(m_Target, stored)  &&  stored == hash;
+        if (!m_Target.empty()) {
+            m_File.RenameOnClose(unchanged ? NULL : m_Target.c_str());
+        }
+        m_Hashes.push_back(hex);
+        m_Unchanged.push_back(unchanged);
+    }
+    if (background) {
+        m_File.CloseInBackground();
+    } else {
         m_File.close();
     }
 }
@@ -595,6 +1176,24 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
     
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
     y -= height;
+
+    // no point embedding more pixels than the output resolution can show
+    vector<unsigned int> downsampled;
+    if (R_FINITE(m_MaxRasterDPI)  &&  m_MaxRasterDPI > 0) {
+        double maxW = ceil(fabs(width)/m_CoordDPI * m_MaxRasterDPI);
+        double maxH = ceil(fabs(height)/m_CoordDPI * m_MaxRasterDPI);
+        int newW = maxW < w ? max(1.0, maxW) : w;
+        int newH = maxH < h ? max(1.0, maxH) : h;
+        if (newW < w  ||  newH < h) {
+            downsampled.resize((size_t)newW*newH);
+            RESAMPLE::Downsample(r, w, h, &downsampled[0], newW, newH,
+                                 interpolate, m_RasterThreads);
+            r = &downsampled[0];
+            w = newW;
+            h = newH;
+        }
+    }
+
     /* Sigh.. as of 2016, LibreOffice support for EMF+ raster ops is broken/missing .*/
     if (m_UseEMFPlus  &&  m_UseEMFPlusRaster) {
         if (rot != 0) {
@@ -610,7 +1209,9 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
              EMFPLUS::eInterpolationModeHighQualityBilinear:
              EMFPLUS::eInterpolationModeNearestNeighbor);
         m1.Write(m_File);
-        EMFPLUS::SDrawImage image(m_ObjectTable.GetImage(r,w,h,m_File), w,h,
+        EMFPLUS::SDrawImage image(m_ObjectTable.GetImage(r,w,h,m_CompressRaster,
+                                                         m_RasterThreads,
+                                                         m_File), w,h,
                                   x, y, width, height);
         image.Write(m_File);
         if (rot != 0) {
@@ -636,7 +1237,8 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
             emr.Write(m_File);
             x = 0; y = -height; //rotate around ll corner
         }
-        EMF::S_STRETCHBLT bmp(r, w,h,x,y,width,height);
+        EMF::S_STRETCHBLT bmp(r, w,h,x,y,width,height, m_CompressRaster,
+                              m_RLERaster);
         bmp.Write(m_File);
         if (rot != 0) {
             EMF::S_SETWORLDTRANSFORM emr;
@@ -679,6 +1281,59 @@ void CDevEMF::Rect(double x0, double y0, double x1, double y1, const pGEcontext
 {
     if (m_debug) Rprintf("rect (converted to poly)\n");
 
+    // hold back borderless rectangles in case they turn out to tile a
+    // grid (e.g., from image()) that is better drawn as one raster
+    bool gridCell = m_RasterizeRects  &&  R_TRANSPARENT(gc->col);
+#if R_GE_version >= 13
+    gridCell = gridCell  &&  gc->patternFill == R_NilValue; //plain fill only
+#endif
+    if (gridCell) {
+        CRectGrid::SRect r = {x0, y0, x1, y1, (unsigned int) gc->fill,
+                              0, 0}; //(cell set by Add)
+        if (!m_RectGrid.Add(r)) {
+            FlushRects();
+            if (!m_RectGrid.Add(r)) {
+                x_Rect(x0, y0, x1, y1, gc);
+                return;
+            }
+        }
+        if (m_RectGrid.Rects().size() == 1) {
+            m_RectGridGC = *gc;
+        }
+        return;
+    }
+    FlushRects();
+    x_Rect(x0, y0, x1, y1, gc);
+}
+
+// draw any held back rectangles: as a raster if they tile enough of
+// a grid, otherwise as they came
+void CDevEMF::FlushRects(void)
+{
+    if (m_RectGrid.Empty()) {
+        return;
+    }
+    //only EMF+ rasters keep transparency (see Raster())
+    if (m_RectGrid.IsRaster(m_UseEMFPlus  &&  m_UseEMFPlusRaster)) {
+        vector<unsigned int> pixels;
+        int w, h;
+        double x, y, width, height;
+        m_RectGrid.GetRaster(pixels, w, h, x, y, width, height);
+        Raster(&pixels[0], w, h, x, y, width, height, 0, FALSE);
+    } else {
+        const vector<CRectGrid::SRect> &rects = m_RectGrid.Rects();
+        for (size_t i = 0;  i < rects.size();  ++i) {
+            m_RectGridGC.fill = rects[i].fill;
+            x_Rect(rects[i].x0, rects[i].y0, rects[i].x1, rects[i].y1,
+                   &m_RectGridGC);
+        }
+    }
+    m_RectGrid.Clear();
+}
+
+void CDevEMF::x_Rect(double x0, double y0, double x1, double y1,
+                     const pGEcontext gc)
+{
     double x[4], y[4];
     x[0] = x[1] = x0;
     x[2] = x[3] = x1;
@@ -759,7 +1414,7 @@ void CDevEMF::Path(double *x, double *y, int nPoly, int *nPts, bool winding,
             fill.Write(m_File);
         }
     } else {
-        Rf_warning("devEMF does not implement 'path' drawing for EMF (only EMF+)");
+        EMF::Warning("devEMF does not implement 'path' drawing for EMF (only EMF+)");
         /*
         if (( winding  &&  m_CurrPolyFill != EMF::ePF_WINDING)  ||
             (!winding  &&  m_CurrPolyFill != EMF::ePF_ALTERNATE)) {
@@ -791,31 +1446,21 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
         startAlign.Write(m_File);
 
         //draw string -- have to convert UTF8 to UTF32
-        unsigned int length = strlen(str);
-        unsigned char len1, len2;
-        unsigned char arr[4];
-        unsigned long ch1, ch2;
-        len2 = SSysFontInfo::UTF8codepointBytes(str[0]);
-        memset(arr, 0, 4); memcpy(arr + 4-len2, str, len2);
-        arr[4-len2] &= 255 >> len2;
-        ch2 = (arr[0] & 63) << 18  |  (arr[1] & 63) << 12  |
-            (arr[2] & 63) << 6  |  (arr[3] & 127);
-        for (unsigned int i = 0;  i < length;  i += len1) {
-            len1 = len2; ch1 = ch2;
+        vector<unsigned int> codepoints;
+        if (!UTF8::AppendCodepoints(codepoints, str, strlen(str))) {
+            Rf_error("Text string not valid UTF-8.");
+        }
+        for (unsigned int i = 0;  i < codepoints.size();  ++i) {
             EMFPLUS::SPath *path = new EMFPLUS::SPath;
-            info->AppendGlyphPath(ch1, *path);
+            info->AppendGlyphPath(codepoints[i], *path);
             int pathId = m_ObjectTable.GetPath(path, m_File);
             EMFPLUS::SFillPath fill(pathId, R_RED(gc->col), R_GREEN(gc->col),
                                     R_BLUE(gc->col), R_ALPHA(gc->col));
             fill.Write(m_File);
-            if (i + len1 < length) {
-                len2 = SSysFontInfo::UTF8codepointBytes(str[i+len1]);
-                memset(arr, 0, 4); memcpy(arr + 4-len2, str+i+len1, len2);
-                arr[4-len2] &= 255 >> len2;
-                ch2 = (arr[0] & 63) << 18  |  (arr[1] & 63) << 12  |
-                    (arr[2] & 63) << 6  |  (arr[3] & 127);
+            if (i+1 < codepoints.size()) {
                 EMFPLUS::STranslateWorldTransform
-                    advance(info->GetAdvance(ch1, ch2), 0);
+                    advance(info->GetAdvance(codepoints[i],
+                                             codepoints[i+1]), 0);
                 advance.Write(m_File);
             }
         }
@@ -834,11 +1479,12 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
             x = 0; y = 0; //because already translated!
         }
         EMFPLUS::SDrawString text
-            (iConvUTF8toUTF16LE(str), gc->col, x_GetFont(gc, info),
+            (gc->col, x_GetFont(gc, info),
              m_ObjectTable.GetStringFormat(hadj < 0.5 ? EMFPLUS::eStrAlignNear:
                                            (hadj==0.5 ? EMFPLUS::eStrAlignCenter:
                                             EMFPLUS::eStrAlignFar),
                                            EMFPLUS::eStrAlignNear, m_File));
+        x_UTF8toUTF16LE(str, text.m_StringUTF16LE);
         if (hadj == 0  ||  hadj == 0.5  ||  hadj == 1) {
             //already taken care of by request to align near/far
             text.m_LayoutRect.x = x;
@@ -902,7 +1548,7 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
         emr.emrtext.options = 0; // from spec, seems should be eETO_NO_RECT, but office does seem to support this
         emr.emrtext.rect.Set(0,0,0,0);
         emr.emrtext.offDx = 0; //0 when not included (spec ambiguous but see https://social.msdn.microsoft.com/Forums/en-US/29e46348-c2eb-44d5-8d1a-47c1ecdc68ff/msemf-emrtextdxbuffer-is-optional-how-to-specify-its-not-specified?forum=os_windowsprotocols)
-        emr.emrtext.str = iConvUTF8toUTF16LE(str);
+        x_UTF8toUTF16LE(str, emr.emrtext.str);
         emr.emrtext.nChars = emr.emrtext.str.length()/2;//spec says number of characters, but both Word & LibreOffice implement #bytes/2 (i.e., they don't collapse unicode supplemental planes that require multiple surrogates)
         emr.Write(m_File);
         /* Commented out for same reason as above
@@ -922,12 +1568,23 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
                          double width, double height, double pointsize,
                          const char *family, int coordDPI, bool customLty,
                          bool emfPlus, bool emfpFont, bool emfpRaster,
-                         bool emfpEmbed)
+                         bool emfpEmbed, bool compressRaster,
+                         bool rleRaster, double maxRasterDPI, unsigned int rasterThreads,
+                         bool rasterizeRects, bool emz,
+                         unsigned int emzThreads, bool asyncWrite,
+                         bool pipeline, bool memoryMap, bool skipUnchanged,
+                         double bufferSize, bool directIO,
+                         const char *templateFile, bool saveTemplate,
+                         SEXP memOut)
 {
     CDevEMF *emf;
 
     if (!(emf = new CDevEMF(family, coordDPI, customLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed))){
+                            emfpRaster, emfpEmbed, compressRaster,
+                            rleRaster, maxRasterDPI, rasterThreads,
+                            rasterizeRects, emz, emzThreads, asyncWrite,
+                            pipeline, memoryMap, skipUnchanged, bufferSize,
+                            directIO, templateFile, saveTemplate))){
 	return FALSE;
     }
     dd->deviceSpecific = (void *) emf;
@@ -1007,7 +1664,7 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
     dd->deviceVersion = R_GE_definitions;
 #endif
 
-    if (!emf->Open(filename, dd->right, dd->top)) 
+    if (!emf->Open(filename, dd->right, dd->top, memOut)) 
 	return FALSE;
 
     return TRUE;
@@ -1015,7 +1672,7 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
 
 /*  EMF Device Driver Parameters
  *  --------------------
- *  file    = output filename
+ *  file    = output filename (NULL for output to memory)
  *  bg	    = background color
  *  fg	    = foreground color
  *  width   = width in inches
@@ -1026,18 +1683,40 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
  *  emfPlus = whether to use EMF+ format
  *  emfpFont = whether to use EMF+ text records
  *  emfpRaster = whether to use EMF+ raster records
+ *  emfpEmbed = whether to convert EMF+ text to paths
+ *  compressRaster = whether to compress raster images
+ *  rleRaster = whether to run-length encode EMF palette bitmaps
+ *  maxRasterDPI = resolution above which rasters are downsampled
+ *  rasterThreads = threads for raster processing (0 = all cores)
+ *  rasterizeRects = whether to draw grids of rectangles as rasters
+ *  emz     = whether to gzip compress the output
+ *  emzThreads = threads for compressing output (0 = all cores)
+ *  asyncWrite = whether to write output from a background thread
+ *  pipeline = whether to draw shapes on a worker thread
+ *  memoryMap = whether to write the file through a memory mapping
+ *  skipUnchanged = whether to leave a file with the same content alone
+ *  bufferSize = bytes buffered when writing files (0 = default)
+ *  directIO = whether to write files bypassing the page cache
+ *  templateFile = template to start from (or save to, with saveTemplate)
+ *  saveTemplate = whether to save a template rather than an EMF file
+ *  memOut = environment to receive output if file is NULL
  */
 extern "C" {
 SEXP devEMF(SEXP args)
 {
     pGEDevDesc dd;
     const char *file, *bg, *fg, *family;
-    double height, width, pointsize;
-    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed;
-    int coordDPI;
+    double height, width, pointsize, maxRasterDPI, bufferSize;
+    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed, compressRaster;
+    Rboolean rleRaster, rasterizeRects, emz, asyncWrite, pipeline, memoryMap;
+    Rboolean skipUnchanged, directIO, saveTemplate;
+    const char *templateFile;
+    SEXP memOut;
+    int coordDPI, rasterThreads, emzThreads;
 
     args = CDR(args); /* skip entry point name */
-    file = Rf_translateChar(Rf_asChar(CAR(args))); args = CDR(args);
+    file = Rf_isNull(CAR(args)) ? NULL : Rf_translateChar(Rf_asChar(CAR(args)));
+    args = CDR(args);
     bg = CHAR(Rf_asChar(CAR(args)));   args = CDR(args);
     fg = CHAR(Rf_asChar(CAR(args)));   args = CDR(args);
     width = Rf_asReal(CAR(args));	     args = CDR(args);
@@ -1050,6 +1729,42 @@ SEXP devEMF(SEXP args)
     emfpFont = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpRaster = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpEmbed = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    compressRaster = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    rleRaster = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    maxRasterDPI = Rf_asReal(CAR(args));     args = CDR(args);
+    rasterThreads = Rf_asInteger(CAR(args));     args = CDR(args);
+    rasterizeRects = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    emz = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    emzThreads = Rf_asInteger(CAR(args));     args = CDR(args);
+    asyncWrite = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    pipeline = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    memoryMap = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    skipUnchanged = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    bufferSize = Rf_asReal(CAR(args));     args = CDR(args);
+    directIO = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    templateFile = Rf_isNull(CAR(args)) ? NULL :
+        Rf_translateChar(Rf_asChar(CAR(args)));
+    args = CDR(args);
+    saveTemplate = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    memOut = CAR(args);     args = CDR(args);
+#ifndef HAVE_ZLIB
+    if (emz) {
+        Rf_warning("emz output requires zlib; writing uncompressed EMF");
+        emz = FALSE;
+    }
+#endif
+#ifndef SINK_MMAP
+    if (memoryMap) {
+        Rf_warning("memoryMap is not supported on this platform");
+        memoryMap = FALSE;
+    }
+#endif
+#ifndef SINK_DIRECT
+    if (directIO) {
+        Rf_warning("directIO is not supported on this platform");
+        directIO = FALSE;
+    }
+#endif
 
     R_GE_checkVersionOrDie(R_GE_version);
     R_CheckDeviceAvailable();
@@ -1059,7 +1774,11 @@ SEXP devEMF(SEXP args)
 	    return 0;
 	if(!EMFDeviceDriver(dev, file, bg, fg, width, height, pointsize,
                             family, coordDPI, userLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed)) {
+                            emfpRaster, emfpEmbed, compressRaster,
+                            rleRaster, maxRasterDPI, rasterThreads,
+                            rasterizeRects, emz, emzThreads, asyncWrite,
+                            pipeline, memoryMap, skipUnchanged, bufferSize,
+                            directIO, templateFile, saveTemplate, memOut)) {
 	    free(dev);
 	    Rf_error("unable to start %s() device", "emf");
 	}
@@ -1069,8 +1788,26 @@ SEXP devEMF(SEXP args)
     return R_NilValue;
 }
 
+SEXP devEMFPrewarm(SEXP args)
+{
+    args = CDR(args); /* skip entry point name */
+    SEXP family = CAR(args); args = CDR(args);
+    SEXP face = CAR(args); args = CDR(args);
+
+    vector<SSysFontInfo::SFontSpec> specs;
+    for (int i = 0;  i < Rf_length(family);  ++i) {
+        for (int j = 0;  j < Rf_length(face);  ++j) {
+            specs.push_back(SSysFontInfo::SFontSpec
+                            (CHAR(STRING_ELT(family, i)),
+                             INTEGER(face)[j], 12));
+        }
+    }
+    return Rf_ScalarLogical(SSysFontInfo::Prewarm(specs));
+}
+
     const R_ExternalMethodDef ExtEntries[] = {
-        {"devEMF", (DL_FUNC)&devEMF, 13},
+        {"devEMF", (DL_FUNC)&devEMF, 29},
+        {"devEMFPrewarm", (DL_FUNC)&devEMFPrewarm, 2},
 	{NULL, NULL, 0}
     };
     void R_init_devEMF(DllInfo *dll) {
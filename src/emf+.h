@@ -30,6 +30,8 @@
 #include <vector>
 
 #include "emf.h"
+#include "png.h"
+#include "hash.h"
 
 // structs for EMF+
 namespace EMFPLUS {
@@ -187,6 +189,8 @@ namespace EMFPLUS {
     // ------------------------------------------------------------------------
     // EMF Objects used repeatedly
     const TUInt4 kVersion = 0xDBC01002; //specifies EMF+ and GDI+ version 1.1
+    // larger object records are split into continuation records
+    const size_t kMaxRecordSize = 32768;
     const unsigned int kMaxObjTableSize = 64; //max entries in object table
 
     struct SPointF {
@@ -235,38 +239,99 @@ namespace EMFPLUS {
         TUInt4 nSize;
         TUInt4 nDataSize;
         SRecord(ERecordType t) : iType(t), iFlags(0), nSize(0), nDataSize(0) {}
+        virtual ~SRecord(void) {}
         virtual std::string& Serialize(std::string &o) const {
             return o << TUInt2(iType) << TUInt2(iFlags) << nSize << nDataSize;
         }
+        // bulk data following the serialized fields, written straight
+        // to the file rather than copied into the record buffer (n
+        // bytes starting at offset, as records may be split)
+        virtual size_t PayloadSize(void) const { return 0; }
+        virtual void WritePayload(EMF::ofstream &, size_t /*offset*/,
+                                  size_t /*n*/) const {}
         void Write(EMF::ofstream &o) {
-            if (!o.inEMFplus) { //write encapsulating EMF record
+            std::string buff; Serialize(buff);
+            size_t payloadSize = PayloadSize();
+            size_t size = ((buff.size() + payloadSize + 3)/4)*4; //add padding
+            bool continued = iType == eRcdObject  &&  size > kMaxRecordSize;
+            if (!o.Seekable()) {
+                // can't grow the encapsulating EMF record once written,
+                // so give each record its own (sized up front)
+                const size_t kChunkSize = kMaxRecordSize - 16;
+                size_t total = !continued ? size :
+                    size - 12 + 16*((size - 12 + kChunkSize - 1)/kChunkSize);
+                EMF::SPlusRecord emr;
+                emr.nPlusSize = total;
+                o.inEMFplus = false; //no GetDC between EMF+ records
+                emr.Write(o);
+                o.inEMFplus = true;
+            } else if (!o.inEMFplus) { //write encapsulating EMF record
                 EMF::SPlusRecord emr;
                 emr.Write(o);
                 o.emfPlusStartPos = o.tellp();
                 o.inEMFplus = true;
             }
-            std::string buff; Serialize(buff);
-            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string dataSize; dataSize << TUInt4(buff.size()-12);
-            std::string finalSize; finalSize << TUInt4(buff.size());
-            buff.replace(4,4, finalSize);
-            buff.replace(8,4, dataSize);
-            o.write(buff.data(), buff.size());
+            if (continued) {
+                x_WriteContinued(o, buff, payloadSize, size - 12);
+            } else {
+                std::string dataSize; dataSize << TUInt4(size-12);
+                std::string finalSize; finalSize << TUInt4(size);
+                buff.replace(4,4, finalSize);
+                buff.replace(8,4, dataSize);
+                x_WriteData(o, buff, payloadSize, 0, size);
+            }
 
-            // update the size of the encapsulating EMF record
-            std::streampos currPos = o.tellp();
-            // back up to Size field
-            o.seekp(o.emfPlusStartPos - (std::streampos)12);
-            buff.clear();
-            buff << TUInt4((int)(currPos - o.emfPlusStartPos) + 16)
-                 << TUInt4((int)(currPos - o.emfPlusStartPos) + 4);
-            o.write(buff.data(), buff.size());
-            o.seekp(currPos);
+            if (o.Seekable()) {
+                // update the size of the encapsulating EMF record
+                std::streampos currPos = o.tellp();
+                // back up to Size field
+                o.seekp(o.emfPlusStartPos - (std::streampos)12);
+                buff.clear();
+                buff << TUInt4((int)(currPos - o.emfPlusStartPos) + 16)
+                     << TUInt4((int)(currPos - o.emfPlusStartPos) + 4);
+                o.write(buff.data(), buff.size());
+                o.seekp(currPos);
+            }
 
             if (iType == eRcdEndOfFile) {
                 o.inEMFplus = false;
             }
         }
+    private:
+        // Write n bytes starting at offset of the record made of buff
+        // (the serialized fields), the payload and zero padding
+        void x_WriteData(EMF::ofstream &o, const std::string &buff,
+                         size_t payloadSize, size_t offset, size_t n) const {
+            if (offset < buff.size()) {
+                size_t len = std::min(n, buff.size() - offset);
+                o.write(buff.data() + offset, len);
+                offset += len;
+                n -= len;
+            }
+            size_t payloadEnd = buff.size() + payloadSize;
+            if (n > 0  &&  offset < payloadEnd) {
+                size_t len = std::min(n, payloadEnd - offset);
+                WritePayload(o, offset - buff.size(), len);
+                offset += len;
+                n -= len;
+            }
+            o.write("\0\0\0", n); //padding
+        }
+        // Objects too large for one record are split into records with
+        // the continuation flag set (on all of them, as GDI+ does and
+        // readers expect) and the total object data size
+        void x_WriteContinued(EMF::ofstream &o, const std::string &buff,
+                              size_t payloadSize, size_t objSize) const {
+            const size_t kChunkSize = kMaxRecordSize - 16;
+            for (size_t offset = 0;  offset < objSize;  offset += kChunkSize) {
+                size_t len = std::min(kChunkSize, objSize - offset);
+                std::string head;
+                head << TUInt2(iType) << TUInt2(iFlags | 0x8000) <<
+                    TUInt4(16 + len) << TUInt4(4 + len) << TUInt4(objSize);
+                o.write(head.data(), head.size());
+                x_WriteData(o, buff, payloadSize, 12 + offset, len);
+            }
+        }
     };
 
     struct SHeader : SRecord {
@@ -419,6 +484,9 @@ namespace EMFPLUS {
         EObjectType type;
         SObject(EObjectType t) : SRecord(eRcdObject), type(t) {}
         virtual ~SObject(void) {}
+        // called once the object has been written; drop anything not
+        // needed to identify the object in the object table
+        virtual void Release(void) {}
         void SetObjId(unsigned char id) {
             iFlags = ((unsigned int)type << 8) | id;
         }
@@ -644,22 +712,45 @@ namespace EMFPLUS {
         }
         std::string& Serialize(std::string &o) const {
             SObject::Serialize(o);
-            o << kVersion << TUInt4(m_TotalPts) << TUInt4(0);
-            for (unsigned int i = 0;  i < m_TotalPts;  ++i) {
-                o << m_Points[i];
+            return o << kVersion << TUInt4(m_TotalPts) << TUInt4(0);
+        }
+        // points (8 bytes each) then point types (1 byte each) are
+        // serialized piecewise as the record is written
+        size_t PayloadSize(void) const {
+            return 9*(size_t)m_TotalPts;
+        }
+        void WritePayload(EMF::ofstream &o, size_t offset, size_t n) const {
+            const size_t kPtBytes = 8*(size_t)m_TotalPts;
+            std::string buff;
+            if (offset < kPtBytes) {
+                size_t end = std::min(kPtBytes, offset + n);
+                for (size_t i = offset/8;  i < (end + 7)/8;  ++i) {
+                    buff << m_Points[i];
+                }
+                o.write(buff.data() + offset%8, end - offset);
+                n -= end - offset;
+                offset = end;
+                buff.clear();
             }
-            unsigned int polyStart = 0;
-            for (unsigned int i = 0;  i < m_NPointsPerPoly.size();  ++i) {
-                for (unsigned int j = 0;  j < m_NPointsPerPoly[i];  ++j) {
-                    if (j < m_NPointsPerPoly[i] - 1) { //normal point
-                        o << TUInt1((0x2 << 4) | m_PtType[j+polyStart]);
-                    } else {//close path
-                        o << TUInt1((0x8 << 4) | m_PtType[j+polyStart]); 
-                    }
+            if (n == 0) {
+                return;
+            }
+            size_t ptI = offset - kPtBytes;
+            unsigned int poly = 0, polyEnd = m_NPointsPerPoly[0];
+            while (polyEnd <= ptI) {
+                polyEnd += m_NPointsPerPoly[++poly];
+            }
+            for (size_t end = ptI + n;  ptI < end;  ++ptI) {
+                while (ptI >= polyEnd) {
+                    polyEnd += m_NPointsPerPoly[++poly];
+                }
+                if (ptI < polyEnd - 1) { //normal point
+                    buff << TUInt1((0x2 << 4) | m_PtType[ptI]);
+                } else {//close path
+                    buff << TUInt1((0x8 << 4) | m_PtType[ptI]);
                 }
-                polyStart += m_NPointsPerPoly[i];
             }
-            return o;
+            o.write(buff.data(), buff.size());
         }
         friend bool operator< (const SPath& p1, const SPath& p2) {
             if (p1.m_TotalPts < p2.m_TotalPts) {
@@ -825,13 +916,12 @@ namespace EMFPLUS {
         unsigned char m_StringFormatId;
         SRectF m_LayoutRect;
         std::string m_StringUTF16LE;
-        SDrawString(const std::string &s,
-                    unsigned int col, unsigned char fontId,
+        SDrawString(unsigned int col, unsigned char fontId,
                     unsigned char stringFormatId) :
             SRecord(eRcdDrawString), m_Brush(col) {
             iFlags = 1 << 15 | fontId; //bit indicates color specified here
             m_StringFormatId = stringFormatId;
-            m_StringUTF16LE = s;
+            //caller fills in m_StringUTF16LE
         }
         std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << m_Brush << TUInt4(m_StringFormatId)
@@ -865,28 +955,61 @@ namespace EMFPLUS {
 
     struct SImage : SObject {
         unsigned int m_W, m_H;
-        std::string m_RawARGB;
+        HASH::TUInt8 m_Hash; //of pixels; identifies repeats of an image
+        bool m_Compressed; //m_Data is PNG rather than raw ARGB
+        std::string m_Data;
+        const unsigned int *m_Pixels; //caller's pixels (uncompressed only)
+        // note pixel data is only encoded by Encode, so that can be
+        // skipped if the image is already in the object table
         SImage(unsigned int *data, unsigned int w, unsigned int h) :
         SObject(eTypeImage) {
             m_W = w;
             m_H = h;
-            m_RawARGB.resize(w*h*4);
-            for (unsigned int i = 0;  i < m_W*m_H; ++i) {
-                m_RawARGB[4*i+0] = R_BLUE(data[i]);
-                m_RawARGB[4*i+1] = R_GREEN(data[i]);
-                m_RawARGB[4*i+2] = R_RED(data[i]);
-                m_RawARGB[4*i+3] = R_ALPHA(data[i]);
+            m_Hash = HASH::Hash64(data, (size_t)w*h*sizeof(unsigned int));
+            m_Compressed = false;
+            m_Pixels = NULL;
+        }
+        // data must remain valid until the image is written
+        void Encode(unsigned int *data, bool compress,
+                    unsigned int maxThreads) {
+#ifdef HAVE_ZLIB
+            // keep PNG only if it actually is smaller (e.g., not for
+            // tiny or noise-like images)
+            if (compress  &&  PNG::Encode(m_Data, data, m_W, m_H, maxThreads)  &&
+                m_Data.size() < (size_t)m_W*m_H*4) {
+                m_Compressed = true;
+                return;
             }
+            m_Data.clear();
+#endif
+            m_Pixels = data; //converted to ARGB as written
+        }
+        void Release(void) {
+            std::string().swap(m_Data);
+            m_Pixels = NULL;
         }
         std::string& Serialize(std::string &o) const {
-            SObject::Serialize(o) << kVersion << TUInt4(1) <<
-                TUInt4(m_W) << TUInt4(m_H) << TUInt4(4*m_W) <<
-                TUInt4(0x26200A) <<
+            // stride and pixel format are 0 (ignored) for compressed
+            // bitmaps
+            return SObject::Serialize(o) << kVersion << TUInt4(1) <<
+                TUInt4(m_W) << TUInt4(m_H) <<
+                TUInt4(m_Compressed ? 0 : 4*m_W) <<
+                TUInt4(m_Compressed ? 0 : 0x26200A) <<
                 //TUInt4(32 << 16 | 10 << 24) << 
-                TUInt4(0);
-            o.append(m_RawARGB);
-            return o;
+                TUInt4(m_Compressed ? 1 : 0); //bitmap type
 	}
+        size_t PayloadSize(void) const {
+            return m_Compressed ? m_Data.size() : (size_t)m_W*m_H*4;
+        }
+        void WritePayload(EMF::ofstream &o, size_t offset, size_t n) const {
+            if (m_Compressed) {
+                o.write(m_Data.data() + offset, n);
+                return;
+            }
+            // the serialized fields and record chunks are multiples of
+            // 4 bytes, so ranges always cover whole pixels
+            EMF::WriteBGRA(o, m_Pixels + offset/4, n/4);
+        }
     };
 
     SPen::SPen(unsigned int col, double lwd, unsigned int lty,
@@ -903,8 +1026,9 @@ namespace EMFPLUS {
             case LTY_DOTDASH: pen.lineStyle = eLineDashDot; break;
             case LTY_LONGDASH: pen.lineStyle = eLineDashDotDot; break;
             default: pen.lineStyle = eLineSolid;
-                Rf_warning("Requested lty is unsupported by EMF device without "
-                           "custom line types (see option to 'emf' function)");
+                EMF::Warning("Requested lty is unsupported by EMF device "
+                             "without custom line types (see option to "
+                             "'emf' function)");
             }
         } else { //custom line style is preferable
             for(int i = 0;  i < 8  &&  lty & 15;  ++i, lty >>= 4) {
@@ -986,7 +1110,12 @@ namespace EMFPLUS {
                         *dynamic_cast<const SPath*>(o2);
                 }
                 case eTypeImage: {
-                    return false; //assume images are unique
+                    const SImage* i1 = dynamic_cast<const SImage*>(o1);
+                    const SImage* i2 = dynamic_cast<const SImage*>(o2);
+                    return i1->m_Hash < i2->m_Hash  ||
+                        (i1->m_Hash == i2->m_Hash  &&
+                         (i1->m_W < i2->m_W  ||
+                          (i1->m_W == i2->m_W  &&  i1->m_H < i2->m_H)));
                 }
                 default: {//should never happen!
                     throw std::logic_error("EMF+ object table scrambled");
@@ -1001,13 +1130,32 @@ namespace EMFPLUS {
     public:
         CObjectTable(void) {
             m_LastInserted = kMaxObjTableSize-1;
+            m_NumInserted = 0;
             memset(m_Table, 0, sizeof(m_Table));
+            memset(m_Serial, 0, sizeof(m_Serial));
         }
         ~CObjectTable(void) {
             for (unsigned int i = 0;  i < kMaxObjTableSize;  ++i) {
                 delete m_Table[i];
             }
         }
+        // Forget all objects (when starting a new file).  Serials keep
+        // counting, so ids cached by callers are recognized as stale.
+        void Clear(void) {
+            for (unsigned int i = 0;  i < kMaxObjTableSize;  ++i) {
+                delete m_Table[i];
+                m_Table[i] = NULL;
+            }
+            m_Index.clear();
+            m_LastInserted = kMaxObjTableSize-1;
+        }
+        // Slot of the last object inserted, and (for a table cleared
+        // after copying in records from a template) carrying on from
+        // the template's last slot, so its objects are replaced last
+        unsigned int GetLast(void) const { return m_LastInserted; }
+        void Continue(unsigned int last) {
+            m_LastInserted = last % kMaxObjTableSize;
+        }
 
         unsigned char GetPen(unsigned int col, double lwd, unsigned int lty,
                              unsigned int lend, unsigned int ljoin,
@@ -1039,10 +1187,23 @@ namespace EMFPLUS {
             return x_InsertObject(path, out);
         }
         unsigned char GetImage(unsigned int *data, int w, int h,
-                              EMF::ofstream &out) {
+                               bool compress, unsigned int maxThreads,
+                               EMF::ofstream &out) {
             SImage *image = new SImage(data, w, h);
+            if (m_Index.find(image) == m_Index.end()) {
+                image->Encode(data, compress, maxThreads);
+            } //else x_InsertObject reuses the existing (identical) image
             return x_InsertObject(image, out);
         }
+
+        // objects get evicted as the table wraps around, so callers
+        // caching an id must also keep its serial and check it here
+        unsigned int GetSerial(unsigned char id) const {
+            return m_Serial[id];
+        }
+        bool HasObject(unsigned char id, unsigned int serial) const {
+            return m_Table[id]  &&  m_Serial[id] == serial;
+        }
     private:
         //note: takes ownership over pointer!
         unsigned char x_InsertObject(SObject *obj, EMF::ofstream &out) {
@@ -1055,9 +1216,11 @@ namespace EMFPLUS {
                     delete old;
                 }
                 m_Table[m_LastInserted] = obj;
+                m_Serial[m_LastInserted] = ++m_NumInserted;
                 obj->SetObjId(m_LastInserted);
                 i = m_Index.insert(obj).first;
                 obj->Write(out);
+                obj->Release();
             } else {
                 delete obj;
             }
@@ -1065,7 +1228,9 @@ namespace EMFPLUS {
         }
     private:
         SObject* m_Table[kMaxObjTableSize];
+        unsigned int m_Serial[kMaxObjTableSize];
         unsigned int m_LastInserted;
+        unsigned int m_NumInserted;
         typedef std::set<SObject*, ObjectPtrCmp> TIndex;
         TIndex m_Index;
     };
@@ -31,14 +31,287 @@
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <fstream>
+#include <streambuf>
+#include <thread>
+#include <system_error>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "palette.h"
+#include "rle.h"
+#include "sink.h"
+#include "emz.h"
+
+#if defined(__SSE2__)  ||  defined(_M_X64)
+#define EMF_SSE2
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
 
 namespace EMF {
-    struct ofstream : std::ofstream {
+    // Output of EMF records: to a file (possibly memory mapped), to
+    // memory (if opened without a filename) or to a command (for a
+    // filename "|command"), optionally through a background writer
+    // thread and/or gzip compressed.  Only the EMF header can be
+    // patched by seeking back on all of these (see Seekable()).
+    struct ofstream : std::ostream {
         bool inEMFplus;
         unsigned int nRecords;
         std::streampos emfPlusStartPos;
-        ofstream(void) : std::ofstream() { inEMFplus = false; nRecords = 0;}
+        ofstream(void) : std::ostream(NULL) {
+            inEMFplus = false;
+            nRecords = 0;
+            m_Sinks = NULL;
+            m_ClosedOk = true;
+        }
+        ~ofstream(void) {
+            x_JoinClosing();
+            delete m_Sinks;
+        }
+        // (writing files with direct I/O in blocks of bufferSize if
+        // direct is set and that is available, else through a memory
+        // mapping if map is set and that is available, else through a
+        // buffer of bufferSize, if not 0)
+        void open(const char *filename, std::ios_base::openmode mode,
+                  bool map = false, size_t bufferSize = 0,
+                  bool direct = false) {
+            delete m_Sinks;
+            m_Sinks = new SSinks;
+            inEMFplus = false;
+            nRecords = 0;
+            std::streambuf *base = NULL;
+            if (!filename) {
+                base = &m_Sinks->mem;
+            } else if (filename[0] == '|') {
+                m_Sinks->pipe = new SINK::CPipeBuf(filename + 1);
+                if (m_Sinks->pipe->IsOpen()) {
+                    base = m_Sinks->pipe;
+                }
+#ifdef SINK_DIRECT
+            } else if (direct  &&
+                       m_Sinks->direct.Open(filename, bufferSize ?
+                                            bufferSize : 1 << 20)) {
+                base = &m_Sinks->direct;
+#endif
+#ifdef SINK_MMAP
+            } else if (map) {
+                if (m_Sinks->map.Open(filename)) {
+                    base = &m_Sinks->map;
+                }
+#endif
+            } else {
+                if (bufferSize > 0) {
+                    m_Sinks->fileBuffer.resize(bufferSize);
+                    m_Sinks->file.pubsetbuf(&m_Sinks->fileBuffer[0],
+                                            bufferSize);
+                }
+                if (m_Sinks->file.open(filename, mode | std::ios_base::out)) {
+                    base = &m_Sinks->file;
+                }
+            }
+            if (filename  &&  filename[0] != '|') {
+                m_Sinks->path = filename;
+            }
+            m_Sinks->base = base;
+            if (base) {
+                rdbuf(base);
+            } else {
+                setstate(std::ios_base::failbit);
+            }
+        }
+        // Write from a background thread from now on
+        void Async(void) {
+            m_Sinks->async = new SINK::CAsyncBuf(rdbuf());
+            rdbuf(m_Sinks->async);
+        }
+#ifdef HAVE_ZLIB
+        // Compress everything written from now on (as .emz)
+        void Deflate(unsigned int maxThreads) {
+            m_Sinks->deflate = new EMZ::CDeflateBuf(rdbuf(), maxThreads);
+            rdbuf(m_Sinks->deflate);
+        }
+#endif
+        // Hash everything written after the EMF header (see
+        // ContentHash()), starting from seed
+        void Hash(HASH::TUInt8 seed) {
+            m_Sinks->hash = new SINK::CHashBuf(rdbuf(), seed);
+            rdbuf(m_Sinks->hash);
+        }
+        bool Hashing(void) const { return m_Sinks  &&  m_Sinks->hash; }
+        // (0 if not hashing)
+        HASH::TUInt8 ContentHash(void) {
+            return Hashing() ? m_Sinks->hash->Hash() : 0;
+        }
+        // Once the output file is closed, rename it to target
+        // (replacing any file there), or delete it if target is NULL
+        void RenameOnClose(const char *target) {
+            m_Sinks->rename = true;
+            m_Sinks->target = target ? target : "";
+        }
+        // Called once the EMF header is written: from then on, output
+        // may be passed on as it is written
+        void EndHeader(void) {
+            if (m_Sinks->hash) m_Sinks->hash->Start();
+#ifdef HAVE_ZLIB
+            if (m_Sinks->deflate) m_Sinks->deflate->EndHead();
+#endif
+            if (m_Sinks->async) m_Sinks->async->Drain();
+            if (m_Sinks->pipe) m_Sinks->pipe->EndHead();
+        }
+        // whether records after the EMF header can be patched
+        bool Seekable(void) const {
+            if (m_Sinks->hash) return false; //patches would go unhashed
+#ifdef SINK_DIRECT
+            //(only the first block is kept in memory)
+            if (m_Sinks->base == &m_Sinks->direct) return false;
+#endif
+#ifdef HAVE_ZLIB
+            if (m_Sinks->deflate) return false;
+#endif
+            return !m_Sinks->pipe;
+        }
+        // (also waits for any output closed in the background, failing
+        // if that did)
+        void close(void) {
+            bool ok = !fail();
+            if (m_Sinks) {
+                ok = m_Sinks->Finish()  &&  ok;
+                if (m_Sinks->base) {
+                    rdbuf(m_Sinks->base);
+                }
+            }
+            x_JoinClosing();
+            ok = m_ClosedOk  &&  ok;
+            m_ClosedOk = true;
+            if (!ok) {
+                setstate(std::ios_base::failbit);
+            }
+        }
+        // As close(), but finishing the output (compressing, flushing
+        // and closing it) on another thread while the stream is
+        // reopened for more.  Failures are reported by close().
+        void CloseInBackground(void) {
+            x_JoinClosing();
+            SSinks *sinks = m_Sinks;
+            bool ok = !fail();
+            m_Sinks = NULL;
+            rdbuf(NULL);
+            if (!sinks) {
+                return;
+            }
+            try {
+                m_Closing = std::thread([this, sinks, ok](void) {
+                        x_Finish(sinks, ok);
+                    });
+            } catch (const std::system_error &) {
+                x_Finish(sinks, ok);
+            }
+        }
+        bool InMemory(void) const {
+            return m_Sinks  &&  m_Sinks->base == &m_Sinks->mem;
+        }
+        const std::vector<char>& MemoryData(void) const {
+            return m_Sinks->mem.Data();
+        }
+        void ClearMemory(void) { m_Sinks->mem.Clear(); }
+    private:
+        // The buffers output passes through, kept together so a
+        // finished output can be closed off while the stream moves on
+        struct SSinks {
+            std::streambuf *base; //final destination
+            std::filebuf file;
+            std::vector<char> fileBuffer; //(if not the default)
+#ifdef SINK_MMAP
+            SINK::CMapBuf map;
+#endif
+#ifdef SINK_DIRECT
+            SINK::CDirectBuf direct;
+#endif
+            SINK::CMemBuf mem;
+            SINK::CPipeBuf *pipe;
+            SINK::CAsyncBuf *async;
+#ifdef HAVE_ZLIB
+            EMZ::CDeflateBuf *deflate;
+#endif
+            SINK::CHashBuf *hash;
+            std::string path; //of the file written (if any)
+            bool rename; //path to target (or delete it) when finished
+            std::string target;
+            SSinks(void) : base(NULL), pipe(NULL), async(NULL), hash(NULL),
+                           rename(false) {
+#ifdef HAVE_ZLIB
+                deflate = NULL;
+#endif
+            }
+            ~SSinks(void) {
+                delete hash;
+#ifdef HAVE_ZLIB
+                delete deflate;
+#endif
+                delete async;
+                delete pipe;
+            }
+            // pass on everything written and close the destination
+            bool Finish(void) {
+                bool ok = true;
+#ifdef HAVE_ZLIB
+                if (deflate) {
+                    ok = deflate->Finish()  &&  ok;
+                }
+#endif
+                if (async) {
+                    ok = async->Finish()  &&  ok;
+                }
+                if (pipe) {
+                    ok = pipe->Finish()  &&  ok;
+                }
+                if (file.is_open()) {
+                    ok = file.close()  &&  ok;
+                }
+#ifdef SINK_MMAP
+                if (map.IsOpen()) {
+                    ok = map.Finish()  &&  ok;
+                }
+#endif
+#ifdef SINK_DIRECT
+                if (direct.IsOpen()) {
+                    ok = direct.Finish()  &&  ok;
+                }
+#endif
+                if (rename  &&  !path.empty()) {
+                    rename = false;
+                    if (ok  &&  !target.empty()) {
+#ifdef _WIN32
+                        remove(target.c_str()); //rename does not replace
+#endif
+                        ok = ::rename(path.c_str(), target.c_str()) == 0;
+                    } else {
+                        remove(path.c_str());
+                    }
+                }
+                return ok;
+            }
+        };
+        void x_Finish(SSinks *sinks, bool ok) {
+            if (!sinks->Finish()  ||  !ok) {
+                m_ClosedOk = false;
+            }
+            delete sinks;
+        }
+        void x_JoinClosing(void) {
+            if (m_Closing.joinable()) {
+                m_Closing.join();
+            }
+        }
+
+        SSinks *m_Sinks;
+        std::thread m_Closing; //finishing output (see CloseInBackground)
+        bool m_ClosedOk; //set by m_Closing, so read only once joined
     };
 }
 
@@ -47,6 +320,12 @@ namespace EMFPLUS {
     void GetDC(EMF::ofstream &o);
 }
 
+//defined by the device, as records may be built off the R thread (see
+//pipeline.h) where R's warning() is not available
+namespace EMF {
+    void Warning(const char *msg);
+}
+
 // structs for EMF
 namespace EMF {
     enum ERecordType {
@@ -308,9 +587,14 @@ namespace EMF {
         TUInt4 nSize;
         SRecord(ERecordType t) : iType(t), nSize(0) {}
 
+        virtual ~SRecord(void) {}
         virtual std::string& Serialize(std::string &o) const {
             return o << TUInt4(iType) << nSize;
         }
+        // bulk data following the serialized fields, written straight
+        // to the file rather than copied into the record buffer
+        virtual size_t PayloadSize(void) const { return 0; }
+        virtual void WritePayload(EMF::ofstream &) const {}
         void Write(EMF::ofstream &o) {
             if (o.inEMFplus) {
                 EMFPLUS::GetDC(o); // emf+ record to enable reading of emf
@@ -318,10 +602,18 @@ namespace EMF {
             }
             ++o.nRecords;
             std::string buff; Serialize(buff);
-            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string finalSize; finalSize << TUInt4(buff.size());
+            size_t payloadSize = PayloadSize();
+            size_t size = ((buff.size() + payloadSize + 3)/4)*4; //add padding
+            std::string finalSize; finalSize << TUInt4(size);
             buff.replace(4,4, finalSize);
-            o.write(buff.data(), buff.size());
+            if (payloadSize == 0) {
+                buff.resize(size, '\0');
+                o.write(buff.data(), buff.size());
+            } else {
+                o.write(buff.data(), buff.size());
+                WritePayload(o);
+                o.write("\0\0\0", size - buff.size() - payloadSize);
+            }
         }
 };
 
@@ -353,12 +645,15 @@ namespace EMF {
     };
 
     struct SPlusRecord : SRecord {
-        SPlusRecord(void) : SRecord(eEMR_COMMENT) {}
+        size_t nPlusSize; //of the EMF+ records following (if known)
+        SPlusRecord(void) : SRecord(eEMR_COMMENT), nPlusSize(0) {}
         std::string& Serialize(std::string &o) const {
-            SRecord::Serialize(o) << nSize;
+            SRecord::Serialize(o) << TUInt4(nPlusSize + 4);
             o.append("EMF+", 4);
             return o;
         }
+        // the EMF+ records themselves are written by the caller
+        size_t PayloadSize(void) const { return nPlusSize; }
     };
 
     struct SemrText {
@@ -421,8 +716,8 @@ namespace EMF {
             elp.brushStyle = eBS_SOLID;
             elp.color.Set(R_RED(col), R_GREEN(col), R_BLUE(col));
             if (R_ALPHA(col) > 0  &&  R_ALPHA(col) < 255) {
-                Rf_warning("partial transparency is not supported for EMF "
-                           "lines (consider enabling EMF+)");
+                Warning("partial transparency is not supported for EMF "
+                        "lines (consider enabling EMF+)");
             }
             elp.brushHatch = 0;
             elp.numEntries = 0;
@@ -441,7 +736,7 @@ namespace EMF {
                 case LTY_DOTDASH: elp.penStyle |= ePS_DASHDOT; break;
                 case LTY_LONGDASH: elp.penStyle |= ePS_DASHDOTDOT; break;
                 default: elp.penStyle |= ePS_SOLID;
-                    Rf_warning("Using lty unsupported by EMF device");
+                    Warning("Using lty unsupported by EMF device");
                 }
             } else { //custom line style is preferable
                 for(int i = 0;  i < 8  &&  lty & 15;  ++i, lty >>= 4) {
@@ -491,8 +786,8 @@ namespace EMF {
             lb.color.Set(R_RED(col), R_GREEN(col), R_BLUE(col));
             lb.brushHatch = 0; //unused with BS_SOLID or BS_NULL
             if (R_ALPHA(col) > 0  &&  R_ALPHA(col) < 255) {
-                Rf_warning("partial transparency is not supported for EMF "
-                           "fills (consider enabling EMF+)");
+                Warning("partial transparency is not supported for EMF "
+                        "fills (consider enabling EMF+)");
             }
         }
         std::string& Serialize(std::string &o) const {
@@ -742,7 +1037,59 @@ namespace EMF {
         }
     };
 
-    struct S_BITBLT : SRecord {
+    // Write n R raster colors (0xAABBGGRR) as BGRA bytes, converting
+    // a fixed-size chunk at a time (vectorized where available)
+    inline void WriteBGRA(EMF::ofstream &o, const unsigned int *pixels,
+                          size_t n) {
+        const size_t kChunk = 4096; //pixels
+        unsigned int buff[kChunk];
+        for (size_t i = 0;  i < n;  i += kChunk) {
+            size_t len = std::min(kChunk, n - i);
+            const unsigned int *src = pixels + i;
+            size_t j = 0;
+#ifdef EMF_SSE2 //x86 so little-endian: swap red & blue within each int
+#ifdef __AVX2__
+            const __m256i ag8 = _mm256_set1_epi32(0xFF00FF00);
+            const __m256i lo8 = _mm256_set1_epi32(0xFF);
+            for (;  j + 8 <= len;  j += 8) {
+                __m256i v = _mm256_loadu_si256((const __m256i*) (src+j));
+                __m256i r = _mm256_or_si256
+                    (_mm256_and_si256(v, ag8),
+                     _mm256_or_si256
+                     (_mm256_and_si256(_mm256_srli_epi32(v, 16), lo8),
+                      _mm256_slli_epi32(_mm256_and_si256(v, lo8), 16)));
+                _mm256_storeu_si256((__m256i*) (buff+j), r);
+            }
+#endif
+            const __m128i ag = _mm_set1_epi32(0xFF00FF00);
+            const __m128i lo = _mm_set1_epi32(0xFF);
+            for (;  j + 4 <= len;  j += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i*) (src+j));
+                __m128i r = _mm_or_si128
+                    (_mm_and_si128(v, ag),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo),
+                                  _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+                _mm_storeu_si128((__m128i*) (buff+j), r);
+            }
+#endif
+            unsigned char *out = reinterpret_cast<unsigned char*>(buff);
+            for (;  j < len;  ++j) {
+                unsigned int c = src[j];
+                out[4*j+0] = (c >> 16) & 0xFF;
+                out[4*j+1] = (c >> 8) & 0xFF;
+                out[4*j+2] = c & 0xFF;
+                out[4*j+3] = c >> 24;
+            }
+            o.write((const char*) buff, 4*len);
+        }
+    }
+
+    // Device-independent bitmap (BITMAPINFO plus bits) of R raster
+    // data, as embedded in BITBLT/STRETCHBLT records.  The bits are
+    // converted from the caller's pixels as the record is written, so
+    // these must remain valid until then (except for run-length
+    // encoded bitmaps, which are encoded up front).
+    struct SDIB {
         struct SBitmapHeader {
             TUInt4 size;
             TInt4 width, height;
@@ -755,6 +1102,85 @@ namespace EMF {
             TUInt4 colorUsed;
             TUInt4 colorImportant;
         };
+        SBitmapHeader bmpHead;
+        const unsigned int *pixels;
+        unsigned int w, h;
+        CPalette pal;
+        bool indexed;
+        unsigned int bitCount, nColors, rowBytes;
+        std::string rle; //BI_RLE8/BI_RLE4 bits (if smaller than BI_RGB)
+
+        SDIB(const unsigned int *data, unsigned int srcW, unsigned int srcH,
+             bool usePalette, bool allowRLE = false) :
+            pixels(data), w(srcW), h(srcH) {
+            // DIBs have no alpha, so colors only differing in alpha
+            // share a palette entry
+            indexed = usePalette  &&  pal.Build(data, srcW*srcH, 0x00FFFFFF);
+            nColors = indexed ? pal.Size() : 0;
+            bitCount = indexed ? pal.BitDepth(false) : 32;
+            rowBytes = ((srcW*bitCount + 31)/32)*4; //DWORD aligned
+            // run-length encoding only exists for 4 and 8 bits per
+            // pixel, and only pays off for images with runs of a color
+            unsigned int rleBitCount = nColors <= 16 ? 4 : 8;
+            bool useRLE = indexed  &&  allowRLE  &&
+                RLE::Encode(rle, pal, data, srcW, srcH, rleBitCount,
+                            (size_t)rowBytes*srcH - 1);
+            if (useRLE) {
+                bitCount = rleBitCount;
+            }
+            bmpHead.size = 10*4;
+            bmpHead.width = srcW;
+            bmpHead.height = useRLE ? srcH : -srcH; //RLE must be bottom-up
+            bmpHead.planes = 1;
+            bmpHead.bitCount = bitCount;
+            if (useRLE) {
+                bmpHead.compression = bitCount == 8 ? 1 : 2;//BI_RLE8/4
+                bmpHead.imageSize = rle.size();
+            } else {
+                bmpHead.compression = 0;//BI_RGB
+                bmpHead.imageSize = 0; //ignored for BI_RGB
+            }
+            bmpHead.xPelsPerMeter = 1; //arb?
+            bmpHead.yPelsPerMeter = 1;
+            bmpHead.colorUsed = nColors;
+            bmpHead.colorImportant = 0;
+        }
+        unsigned int InfoSize(void) const { //header + color table
+            return 10*4 + 4*nColors;
+        }
+        unsigned int BitsSize(void) const {
+            return rle.empty() ? rowBytes*h : rle.size();
+        }
+        std::string& SerializeInfo(std::string &o) const {
+            o << bmpHead.size << bmpHead.width << bmpHead.height <<
+                bmpHead.planes << bmpHead.bitCount << bmpHead.compression <<
+                bmpHead.imageSize << bmpHead.xPelsPerMeter <<
+                bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
+                bmpHead.colorImportant;
+            for (unsigned int i = 0;  i < nColors; ++i) {
+                o << TUInt1(R_BLUE(pal[i])) << TUInt1(R_GREEN(pal[i])) <<
+                    TUInt1(R_RED(pal[i])) << TUInt1(0); //RGBQUAD
+            }
+            return o;
+        }
+        void WriteBits(EMF::ofstream &o) const {
+            if (!rle.empty()) {
+                o.write(rle.data(), rle.size());
+                return;
+            }
+            if (!indexed) { //32bpp rows need no padding
+                WriteBGRA(o, pixels, (size_t)w*h);
+                return;
+            }
+            std::vector<unsigned char> row(rowBytes, 0);
+            for (unsigned int y = 0;  y < h;  ++y) {
+                pal.PackRow(pixels + (size_t)y*w, w, bitCount, &row[0]);
+                o.write((const char*) &row[0], rowBytes);
+            }
+        }
+    };
+
+    struct S_BITBLT : SRecord {
         SRect bounds;
         TInt4 xDest, yDest;
         TInt4 cxDest,cyDest;
@@ -765,72 +1191,37 @@ namespace EMF {
         TUInt4 usageSrc;
         int offBmiSrc, cbBmiSrc;
         int offBitsSrc, cbBitsSrc;
-        SBitmapHeader bmpHead;
-        std::string bmpData;
+        SDIB dib;
         S_BITBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
                  double x, double y, double w, double h) :
-            SRecord(eEMR_BITBLT) {
+            SRecord(eEMR_BITBLT), dib(data, srcW, srcH, false) {
             bounds.Set(x,x+w,y,y+h);
             xDest = x;
             yDest = y;
             xSrc = ySrc = 0;
             offBmiSrc = 25*4;//offset(S_BITBLT,bmp)
-            cbBmiSrc = 10*4; //size of bitmap header
+            cbBmiSrc = dib.InfoSize(); //size of bitmap header
             offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
+            cbBitsSrc = dib.BitsSize();//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
             bkColorSrc.Set(0,0,0); //src bg color (irrelevant for us)
             cxDest = w;
             cyDest = h;
-            bmpHead.size = cbBmiSrc;
-            bmpHead.width = srcW;
-            bmpHead.height = -srcH;
-            bmpHead.planes = 1;
-            bmpHead.bitCount = 0x20;
-            bmpHead.compression = 0;//BI_RGB
-            bmpHead.imageSize = 0; //ignored for BI_RGB
-            bmpHead.xPelsPerMeter = 1; //arb?
-            bmpHead.yPelsPerMeter = 1;
-            bmpHead.colorUsed = 0;
-            bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
-            }
         }
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
                 cxDest << cyDest << bitBltRasterOp << xSrc << ySrc <<
                 xformSrc << bkColorSrc << usageSrc << TUInt4(offBmiSrc) <<
-                TUInt4(cbBmiSrc) << TUInt4(offBitsSrc) << TUInt4(cbBitsSrc) <<
-                bmpHead.size << bmpHead.width << bmpHead.height <<
-                bmpHead.planes << bmpHead.bitCount << bmpHead.compression <<
-                bmpHead.imageSize << bmpHead.xPelsPerMeter <<
-                bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
-                bmpHead.colorImportant;
-            o.append(bmpData);
-            return o;
+                TUInt4(cbBmiSrc) << TUInt4(offBitsSrc) << TUInt4(cbBitsSrc);
+            return dib.SerializeInfo(o);
         }
+        size_t PayloadSize(void) const { return dib.BitsSize(); }
+        void WritePayload(EMF::ofstream &o) const { dib.WriteBits(o); }
     };
 
     struct S_STRETCHBLT : SRecord {
-        struct SBitmapHeader {
-            TUInt4 size;
-            TInt4 width, height;
-            TUInt2 planes;
-            TUInt2 bitCount;
-            TUInt4 compression;
-            TUInt4 imageSize;
-            TInt4 xPelsPerMeter;
-            TInt4 yPelsPerMeter;
-            TUInt4 colorUsed;
-            TUInt4 colorImportant;
-        };
         SRect bounds;
         TInt4 xDest, yDest;
         TInt4 cxDest,cyDest;
@@ -842,11 +1233,12 @@ namespace EMF {
         int offBmiSrc, cbBmiSrc;
         int offBitsSrc, cbBitsSrc;
         TInt4 cxSrc, cySrc;
-        SBitmapHeader bmpHead;
-        std::string bmpData;
+        SDIB dib;
         S_STRETCHBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
-                     double x, double y, double w, double h) :
-            SRecord(eEMR_STRETCHBLT) {
+                     double x, double y, double w, double h,
+                     bool usePalette, bool allowRLE) :
+            SRecord(eEMR_STRETCHBLT),
+            dib(data, srcW, srcH, usePalette, allowRLE) {
             bounds.Set(x,x+w,y,y+h);
             xDest = x;
             yDest = y;
@@ -854,48 +1246,26 @@ namespace EMF {
             cxSrc = srcW;
             cySrc = srcH;
             offBmiSrc = 27*4;//offset(S_STRETCHBLT,bmp)
-            cbBmiSrc = 10*4; //size of bitmap header
+            cbBmiSrc = dib.InfoSize(); //size of bitmap header + colors
             offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
+            cbBitsSrc = dib.BitsSize();//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
             bkColorSrc.Set(0,0,0); //src bg color (irrelevant for us)
             cxDest = w;
             cyDest = h;
-            bmpHead.size = cbBmiSrc;
-            bmpHead.width = srcW;
-            bmpHead.height = -srcH;
-            bmpHead.planes = 1;
-            bmpHead.bitCount = 0x20;
-            bmpHead.compression = 0;//BI_RGB
-            bmpHead.imageSize = 0; //ignored for BI_RGB
-            bmpHead.xPelsPerMeter = 1; //arb?
-            bmpHead.yPelsPerMeter = 1;
-            bmpHead.colorUsed = 0;
-            bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
-            }
         }
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
                 cxDest << cyDest << bitBltRasterOp << xSrc << ySrc <<
                 xformSrc << bkColorSrc << usageSrc << TUInt4(offBmiSrc) <<
                 TUInt4(cbBmiSrc) << TUInt4(offBitsSrc) << TUInt4(cbBitsSrc) <<
-                cxSrc << cySrc <<                 
-                bmpHead.size << bmpHead.width << bmpHead.height <<
-                bmpHead.planes << bmpHead.bitCount << bmpHead.compression <<
-                bmpHead.imageSize << bmpHead.xPelsPerMeter <<
-                bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
-                bmpHead.colorImportant;
-            o.append(bmpData);
-            return o;
+                cxSrc << cySrc;
+            return dib.SerializeInfo(o);
         }
+        size_t PayloadSize(void) const { return dib.BitsSize(); }
+        void WritePayload(EMF::ofstream &o) const { dib.WriteBits(o); }
     };
 
     struct ObjectPtrCmp {
@@ -934,18 +1304,30 @@ namespace EMF {
     class CObjectTable {
     public:
         CObjectTable(void) {
-            for (unsigned int i = 0;  i < eEMR_last;  ++i) {
-                m_CurrObj[i] = -1;
-            }
-            m_CurrMiterLimit = -1;
+            Clear();
         }
         ~CObjectTable(void) {
+            Clear();
+        }
+        // Forget all objects and selections (when starting a new file)
+        void Clear(void) {
             for (TIndex::iterator i = m_Objects.begin();
                  i != m_Objects.end();  ++i) {
                 delete *i;
             }
+            m_Objects.clear();
+            m_NumCopied = 0;
+            for (unsigned int i = 0;  i < eEMR_last;  ++i) {
+                m_CurrObj[i] = -1;
+            }
+            m_CurrMiterLimit = -1;
+        }
+        // Number new objects after n created by records copied from a
+        // template (into a cleared table)
+        void Continue(unsigned int n) { m_NumCopied = n; }
+        unsigned int GetSize(void) const {
+            return m_NumCopied + m_Objects.size();
         }
-        unsigned int GetSize(void) const { return m_Objects.size(); }
 
         unsigned char GetPen(unsigned int col, double lwd, unsigned int lty,
                              unsigned int lend, unsigned int ljoin,
@@ -973,12 +1355,22 @@ namespace EMF {
             SFont *font = new SFont(face, size, familyUTF16, rot);
             return x_SelectObject(font, out)->m_ObjId;
         }
+        // re-select an object already in the table (id cached by caller)
+        void SelectObject(ERecordType type, unsigned int objId,
+                          EMF::ofstream &out) {
+            if (m_CurrObj[type] != (int)objId) {
+                S_SELECTOBJECT emr;
+                emr.ihObject = objId;
+                emr.Write(out);
+                m_CurrObj[type] = objId;
+            }
+        }
     private:
         SObject* x_GetObject(SObject *obj, EMF::ofstream &out) {
             TIndex::iterator i = m_Objects.find(obj);
             if (i == m_Objects.end()) {
                 i = m_Objects.insert(obj).first;
-                obj->m_ObjId = m_Objects.size();
+                obj->m_ObjId = GetSize();
                 obj->Write(out);
             } else {
                 delete obj;
@@ -987,17 +1379,13 @@ namespace EMF {
         }
         SObject* x_SelectObject(SObject *obj, EMF::ofstream &out) {
             obj = x_GetObject(obj, out);
-            if (m_CurrObj[obj->iType] != (int)obj->m_ObjId) {
-                S_SELECTOBJECT emr;
-                emr.ihObject = obj->m_ObjId;
-                emr.Write(out);
-                m_CurrObj[obj->iType] = obj->m_ObjId;
-            }
+            SelectObject(obj->iType, obj->m_ObjId, out);
             return obj;
         }
     private:
         typedef std::set<SObject*, ObjectPtrCmp> TIndex;        
         TIndex m_Objects;
+        unsigned int m_NumCopied; //objects created by template records
         int m_CurrObj[eEMR_last];
         int m_CurrMiterLimit;
     };
@@ -0,0 +1,252 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+
+    This header contains a gzip stream buffer for writing compressed
+    (.emz) metafiles as they are produced.  The EMF header, whose
+    totals are only known at the end, is kept uncompressed at the
+    start of the stream so it can be rewritten in place; everything
+    after it is deflated in blocks, several at a time on large plots.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef EMZ__H
+#define EMZ__H
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <streambuf>
+#include <algorithm>
+
+#include "sink.h"
+#include "workers.h"
+
+namespace EMZ {
+    // Independently compressed block of the stream: raw deflate data
+    // ending on a byte boundary (or, for the last block, the end of
+    // the stream), primed with the data preceding it so little
+    // compression is lost to the split
+    struct SBlock {
+        const char *data;
+        size_t n;
+        const char *dict;
+        size_t nDict;
+        bool last;
+        std::string z;
+        uLong crc;
+        bool ok;
+        SBlock(void) : data(NULL), n(0), dict(NULL), nDict(0), last(false),
+                       crc(0), ok(false) {}
+        void Deflate(void) {
+            const unsigned int kOutSize = 1 << 16;
+            ok = false;
+            crc = crc32(0, reinterpret_cast<const Bytef*>(data), n);
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                             -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return;
+            }
+            if (nDict > 0  &&
+                deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dict),
+                                     nDict) != Z_OK) {
+                deflateEnd(&zs);
+                return;
+            }
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            zs.avail_in = n;
+            unsigned char out[kOutSize];
+            do {
+                zs.next_out = out;
+                zs.avail_out = kOutSize;
+                if (deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH) ==
+                    Z_STREAM_ERROR) {
+                    deflateEnd(&zs);
+                    return;
+                }
+                z.append(reinterpret_cast<const char*>(out),
+                         kOutSize - zs.avail_out);
+            } while (zs.avail_out == 0);
+            deflateEnd(&zs);
+            ok = true;
+        }
+    };
+
+    // Stream buffer writing a single-member gzip stream to dest.  The
+    // head is stored uncompressed, so that it can be rewritten in
+    // place by Finish().  Everything after is compressed in blocks of
+    // fixed size on up to maxThreads threads (0 for one per core), so
+    // the output does not depend on the thread count.
+    class CDeflateBuf : public SINK::CHeadBuf {
+    public:
+        CDeflateBuf(std::streambuf *dest, unsigned int maxThreads) :
+            m_Dest(dest), m_Crc(crc32(0, NULL, 0)) {
+            m_Batch = WORKERS::Count(maxThreads, kMaxBatch);
+            m_DestStart = m_Dest->pubseekoff(0, std::ios_base::cur,
+                                             std::ios_base::out);
+        }
+        std::streambuf* Dest(void) const { return m_Dest; }
+
+        // Compress what remains, write the gzip trailer and rewrite
+        // the head if it has been patched
+        bool Finish(void) {
+            EndHead();
+            x_Compress(true);
+            const std::string &head = x_Head();
+            unsigned long long bodySize = x_Size() - head.size();
+            uLong crc = crc32_combine(
+                crc32(0, reinterpret_cast<const Bytef*>(head.data()),
+                      head.size()),
+                m_Crc, bodySize);
+            unsigned int isize = x_Size() & 0xFFFFFFFF;
+            char trailer[8];
+            for (int i = 0;  i < 4;  ++i) {
+                trailer[i] = (crc >> 8*i) & 0xFF;
+                trailer[4+i] = (isize >> 8*i) & 0xFF;
+            }
+            x_Emit(trailer, 8);
+
+            std::string stored = x_StoredHead();
+            if (stored != m_SentHead) { //(never so over a pipe)
+                if (m_DestStart == std::streampos(-1)  ||
+                    m_Dest->pubseekpos(m_DestStart + std::streamoff(10),
+                                       std::ios_base::out) ==
+                    std::streampos(-1)) {
+                    m_Ok = false;
+                } else {
+                    x_Emit(stored.data(), stored.size());
+                    m_Dest->pubseekoff(0, std::ios_base::end,
+                                       std::ios_base::out);
+                }
+            }
+            if (m_Dest->pubsync() != 0) {
+                m_Ok = false;
+            }
+            return m_Ok;
+        }
+
+    protected:
+        void x_HeadDone(void) {
+            // gzip header: deflate, no name, no time, unknown OS
+            static const char header[10] =
+                {'\x1F', '\x8B', 8, 0, 0, 0, 0, 0, 0, '\xFF'};
+            x_Emit(header, sizeof(header));
+            m_SentHead = x_StoredHead();
+            x_Emit(m_SentHead.data(), m_SentHead.size());
+        }
+        void x_Append(const char *s, size_t n) {
+            m_Input.append(s, n);
+            if (m_Input.size() >= m_Batch*(size_t)kBlockSize) {
+                x_Compress(false);
+            }
+        }
+
+    private:
+        // blocks restart the deflate state, so keep them large; a
+        // batch of blocks is buffered to compress them in parallel
+        enum { kBlockSize = 1 << 20, kWindowSize = 1 << 15, kMaxBatch = 16 };
+
+        void x_Emit(const char *s, size_t n) {
+            if (m_Dest->sputn(s, n) != (std::streamsize) n) {
+                m_Ok = false;
+            }
+        }
+        // head as stored (uncompressed) deflate blocks; its size only
+        // depends on the head length, so it can be rewritten in place
+        std::string x_StoredHead(void) const {
+            const std::string &head = x_Head();
+            std::string o;
+            for (size_t i = 0;  i < head.size();  i += 0xFFFF) {
+                unsigned int len = std::min((size_t)0xFFFF, head.size() - i);
+                o += '\0'; //not final, stored
+                o += (char)(len & 0xFF);
+                o += (char)(len >> 8);
+                o += (char)(~len & 0xFF);
+                o += (char)((~len >> 8) & 0xFF);
+                o.append(head, i, len);
+            }
+            return o;
+        }
+        // Compress the full blocks of buffered input (and, if finish,
+        // the rest as the final block) and write them out
+        void x_Compress(bool finish) {
+            size_t nFull = m_Input.size() / kBlockSize;
+            size_t nBlocks = nFull + (finish ? 1 : 0);
+            if (nBlocks == 0) {
+                return;
+            }
+            std::vector<SBlock> blocks(nBlocks);
+            for (size_t i = 0;  i < nBlocks;  ++i) {
+                SBlock &b = blocks[i];
+                b.data = m_Input.data() + i*kBlockSize;
+                b.n = i < nFull ? (size_t) kBlockSize :
+                    m_Input.size() - i*kBlockSize;
+                b.last = i == nFull;
+                if (i == 0) {
+                    b.dict = m_Window.data();
+                    b.nDict = m_Window.size();
+                } else {
+                    b.dict = b.data - kWindowSize;
+                    b.nDict = kWindowSize;
+                }
+            }
+            WORKERS::ParallelFor(nBlocks, WORKERS::Count(m_Batch, nBlocks),
+                                 [&](unsigned int i) { blocks[i].Deflate(); });
+            for (size_t i = 0;  i < nBlocks;  ++i) {
+                if (!blocks[i].ok) {
+                    m_Ok = false;
+                    return;
+                }
+                x_Emit(blocks[i].z.data(), blocks[i].z.size());
+                m_Crc = crc32_combine(m_Crc, blocks[i].crc, blocks[i].n);
+            }
+            size_t used = nFull*kBlockSize;
+            if (used >= kWindowSize) {
+                m_Window.assign(m_Input, used - kWindowSize, kWindowSize);
+            } else {
+                m_Window.append(m_Input, 0, used);
+                if (m_Window.size() > kWindowSize) {
+                    m_Window.erase(0, m_Window.size() - kWindowSize);
+                }
+            }
+            m_Input.erase(0, finish ? m_Input.size() : used);
+        }
+
+        std::streambuf *m_Dest;
+        std::streampos m_DestStart;
+        std::string m_SentHead; //stored head as first written
+        unsigned int m_Batch;
+        std::string m_Input;  //appended data not yet compressed
+        std::string m_Window; //data preceding m_Input (up to 32K)
+        uLong m_Crc; //of the compressed data (excluding the head)
+    };
+} //end of EMZ namespace
+
+#endif //HAVE_ZLIB
+#endif //EMZ__H
@@ -37,6 +37,11 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <deque>
+#include <thread>
+#include <system_error>
+#include <mutex>
+#include <condition_variable>
 #endif
 #ifdef HAVE_XFT
 #include <X11/Xft/Xft.h>
@@ -72,6 +77,8 @@
 #undef FALSE
 #endif /* end __APPLE__ */
 
+#include "utf8.h"
+
 /****************************************************************************/
 // First make definitions common to all three systems
 // then further below split apart system-specific code
@@ -92,7 +99,7 @@ struct SSysFontInfo {
             }
         }
         friend bool operator< (const SFontSpec &s1, const SFontSpec &s2) {
-            int cmp = s1.m_Family.compare(s1.m_Family);
+            int cmp = s1.m_Family.compare(s2.m_Family);
             if (cmp < 0) {
                 return true;
             }
@@ -103,101 +110,366 @@ struct SSysFontInfo {
     };
     SFontSpec m_Spec;
 
-    static unsigned char UTF8codepointBytes(unsigned char c) {
-        if (c < 128) {
-            return 1;
-        } else if (c < 224) {
-            return 2;
-        } else if (c < 240) {
-            return 3;
-        } else {
-            return 4;
+    // EMF/EMF+ font objects last emitted for this spec (filled in and
+    // checked by CDevEMF::x_GetFont so repeated text skips the lookup)
+    struct SObjectCache {
+        std::string familyUTF16;
+        int emfPlusId;
+        unsigned int emfPlusSerial;
+        int emfId;
+        double emfRot;
+        SObjectCache(void) : emfPlusId(-1), emfPlusSerial(0),
+                             emfId(-1), emfRot(0) {}
+    };
+    SObjectCache m_ObjCache;
+
+    static void x_UTF8toCodepoints(const char *str,
+                                   std::vector<unsigned int> &out) {
+        if (!UTF8::AppendCodepoints(out, str, strlen(str))) {
+            Rf_error("Text string not valid UTF-8");
         }
     }
-    
+
     /******** *nix specific ********/
 #ifndef __APPLE__
 #ifndef WIN32
     
 #ifdef HAVE_ZLIB
+    // background thread that is waited for (rather than abandoned) when
+    // the library is unloaded
+    struct SPrewarmThread {
+        std::thread m_Thread;
+        ~SPrewarmThread(void) { Join(); }
+        void Join(void) {
+            if (m_Thread.joinable()) {
+                m_Thread.join();
+            }
+        }
+    };
+
     static std::map<std::string, std::vector<std::string> > afmPathDB;
     static std::string packagePath;
 
-    struct SCharMetric {
-        int code;
-        int w;
-        std::string name;
-        int llx, lly, urx, ury; //bounding box extents
-        double width;
-        double ascent;
-        double descent;
-        SCharMetric(void) {
-            width = ascent = descent = 0;
+    struct SGlyphMetric { //AFM units (1/1000 em); exact as floats
+        float width, ascent, descent;
+    };
+    // Glyph metrics indexed directly by code point, in 256 code point
+    // pages that are only allocated if the font covers part of them
+    class CMetricPages {
+    public:
+        CMetricPages(void) {}
+        ~CMetricPages(void) {
+            for (unsigned int i = 0;  i < m_Pages.size();  ++i) {
+                delete m_Pages[i];
+            }
+        }
+        const SGlyphMetric* Find(unsigned int c) const {
+            const SPage *page = x_Page(c);
+            return (page  &&  page->Has(c & 0xFF)) ? &page->m[c & 0xFF] : NULL;
+        }
+        // returns NULL if metrics for c are already present (or c is not
+        // a valid code point)
+        SGlyphMetric* Insert(unsigned int c) {
+            if (c > 0x10FFFF) {
+                return NULL;
+            }
+            unsigned int p = c >> 8;
+            if (p >= m_Pages.size()) {
+                m_Pages.resize(p+1, NULL);
+            }
+            if (!m_Pages[p]) {
+                m_Pages[p] = new SPage();
+            }
+            SPage &page = *m_Pages[p];
+            unsigned int i = c & 0xFF;
+            if (page.Has(i)) {
+                return NULL;
+            }
+            page.present[i >> 5] |= 1u << (i & 31);
+            return &page.m[i];
+        }
+        // sum of widths scaled to font size; missing is set if any code
+        // point has no metrics (these contribute zero width)
+        double SumWidths(const unsigned int *str32, size_t n, int size,
+                         bool &missing) const {
+            double w = 0;
+            unsigned int miss = 0;
+            for (size_t i = 0;  i < n;  ++i) {
+                const SPage *page = x_Page(str32[i]);
+                if (page) {
+                    unsigned int j = str32[i] & 0xFF;
+                    w += page->m[j].width * 0.001 * size;
+                    miss |= ~page->present[j >> 5] & (1u << (j & 31));
+                } else {
+                    miss = 1;
+                }
+            }
+            missing = miss != 0;
+            return w;
+        }
+    private:
+        struct SPage {
+            SGlyphMetric m[256]; //zero for code points not in the font
+            unsigned int present[8]; //bit set for each code point in font
+            SPage(void) : m(), present() {}
+            bool Has(unsigned int i) const {
+                return (present[i >> 5] >> (i & 31)) & 1;
+            }
+        };
+        const SPage* x_Page(unsigned int c) const {
+            return (c >> 8) < m_Pages.size() ? m_Pages[c >> 8] : NULL;
+        }
+        std::vector<SPage*> m_Pages;
+        CMetricPages(const CMetricPages&); //not copyable
+        CMetricPages& operator=(const CMetricPages&);
+    };
+    mutable CMetricPages m_AFMCharMetrics;
+    struct SFontBBox {
+        double width, ascent, descent;
+    } m_AFMFontBBox;
+    // Symbol & ZapfDingbats fill in characters missing from the
+    // requested font, but are only loaded on the first miss
+    mutable bool m_AFMExtrasLoaded;
+
+    // AFM files as parsed (unscaled, 1/1000 em units), shared by all
+    // fonts and devices.  Files may be parsed ahead of time on a
+    // background thread (see Prewarm).
+    struct SAFMFile {
+        struct SChar {
+            unsigned int code;
+            int w, lly, ury;
+        };
+        int llx, lly, urx, ury; //font bounding box
+        std::vector<SChar> chars;
+    };
+    class CAFMCache {
+    public:
+        CAFMCache(void) : m_Running(false) {}
+        ~CAFMCache(void) {
+            m_Thread.Join();
+            for (TFiles::iterator i = m_Files.begin(); i != m_Files.end(); ++i){
+                delete i->second;
+            }
         }
+        const SAFMFile& Get(const std::string &filename) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            TFiles::iterator i = m_Files.find(filename);
+            if (i == m_Files.end()) {
+                m_Files[filename] = NULL; //mark as being parsed
+                lock.unlock();
+                SAFMFile *afm = Parse(filename);
+                lock.lock();
+                m_Files[filename] = afm;
+                m_Parsed.notify_all();
+                return *afm;
+            }
+            while (!m_Files[filename]) { //prewarm thread is parsing it
+                m_Parsed.wait(lock);
+            }
+            return *m_Files[filename];
+        }
+        // Returns false if no thread could be started (the files are
+        // then parsed when first needed, as usual)
+        bool Prewarm(const std::vector<std::string> &filenames) {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                for (unsigned int i = 0;  i < filenames.size();  ++i) {
+                    if (m_Files.find(filenames[i]) == m_Files.end()) {
+                        m_Files[filenames[i]] = NULL;
+                        m_Queue.push_back(filenames[i]);
+                    }
+                }
+                // files are added to the queue of a thread still
+                // running, so the caller never waits for it
+                if (m_Queue.empty()  ||  m_Running) {
+                    return true;
+                }
+                m_Running = true;
+            }
+            m_Thread.Join(); //any previous thread has finished its work
+            try {
+                m_Thread.m_Thread =
+                    std::thread(&CAFMCache::x_ParseQueued, this);
+            } catch (const std::system_error &) {
+                // out of threads; drop the placeholders, so Get() parses
+                // these files itself rather than waiting for them
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                for (unsigned int i = 0;  i < m_Queue.size();  ++i) {
+                    m_Files.erase(m_Queue[i]);
+                }
+                m_Queue.clear();
+                m_Running = false;
+                m_Parsed.notify_all();
+                return false;
+            }
+            return true;
+        }
+        static SAFMFile* Parse(const std::string &filename) {
+            SAFMFile *afm = new SAFMFile;
+            afm->llx = afm->lly = afm->urx = afm->ury = 0;
+            const unsigned int buffsize = 512;
+            char buff[buffsize];
+            gzFile gz = gzopen(filename.c_str(), "rb");
+            while (gzgets(gz, buff, buffsize)) {
+                std::stringstream iss(buff);
+                std::string key;
+                iss >> key;
+                if (key == "FontBBox") {
+                    iss >> afm->llx >> afm->lly >> afm->urx >> afm->ury;
+                } else if (key == "C") {
+                    SAFMFile::SChar c;
+                    c.w = c.lly = c.ury = 0;
+                    int llx, urx;
+                    iss >> std::hex >> c.code >> std::dec >> key;
+                    while (iss.good()) {
+                        if (key == "WX") {
+                            iss >> c.w;
+                        } else if (key == "B") {
+                            iss >> llx >> c.lly >> urx >> c.ury;
+                        }
+                        iss >> key;
+                    }
+                    afm->chars.push_back(c);
+                }
+            }
+            gzclose(gz);
+            return afm;
+        }
+    private:
+        void x_ParseQueued(void) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            while (!m_Queue.empty()) {
+                std::string filename = m_Queue.front();
+                m_Queue.pop_front();
+                lock.unlock();
+                SAFMFile *afm = Parse(filename);
+                lock.lock();
+                m_Files[filename] = afm;
+                m_Parsed.notify_all();
+            }
+            m_Running = false;
+        }
+        typedef std::map<std::string, SAFMFile*> TFiles;
+        TFiles m_Files;
+        std::mutex m_Mutex;
+        std::condition_variable m_Parsed;
+        std::deque<std::string> m_Queue; //files for the thread to parse
+        bool m_Running; //whether the thread is taking from m_Queue
+        SPrewarmThread m_Thread;
     };
-    typedef std::map<unsigned int,SCharMetric> TMetrics;
-    TMetrics m_AFMCharMetrics;
-    SCharMetric m_AFMFontBBox;
+    static CAFMCache s_AFMCache;
 #endif
 #ifdef HAVE_XFT
     static Display *s_XDisplay; //global connection to X server
+    static bool s_XDisplayTried;
     XftFont *m_FontInfo;
+
+    // connection to the X server is opened on first use; if that
+    // fails, don't retry for every font
+    static Display* x_XDisplay(void) {
+        if (!s_XDisplayTried) {
+            s_XDisplayTried = true;
+            s_XDisplay = XOpenDisplay(NULL);
+        }
+        return s_XDisplay;
+    }
 #endif
 
-    SSysFontInfo(const SFontSpec& spec) : m_Spec(spec) {
 #ifdef HAVE_ZLIB
-        if (afmPathDB.size() == 0) {
-            afmPathDB["Courier"].push_back("Courier-ucs.afm");
-            afmPathDB["Courier"].push_back("Courier-Bold-ucs.afm");
-            afmPathDB["Courier"].push_back("Courier-Oblique-ucs.afm");
-            afmPathDB["Courier"].push_back("Courier-BoldOblique-ucs.afm");
-            afmPathDB["Helvetica"].push_back("Helvetica-ucs.afm");
-            afmPathDB["Helvetica"].push_back("Helvetica-Bold-ucs.afm");
-            afmPathDB["Helvetica"].push_back("Helvetica-Oblique-ucs.afm");
-            afmPathDB["Helvetica"].push_back("Helvetica-BoldOblique-ucs.afm");
-            afmPathDB["sans"] = afmPathDB["Helvetica"];
-            afmPathDB["Times"].push_back("Times-Roman-ucs.afm");
-            afmPathDB["Times"].push_back("Times-Bold-ucs.afm");
-            afmPathDB["Times"].push_back("Times-Italic-ucs.afm");
-            afmPathDB["Times"].push_back("Times-BoldItalic-ucs.afm");
-            afmPathDB["serif"] = afmPathDB["times"];
-            afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
-            afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
-            afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
-            afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
-            afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
-            afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
-            afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
-            afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
-
-            //find full path to package using R "findPackage" function
-            SEXP findPackage, call;
-            PROTECT(findPackage = Rf_findFun(Rf_install("find.package"),
-                                             R_GlobalEnv));
-            PROTECT(call = Rf_lang2(findPackage, Rf_ScalarString
-                                    (Rf_mkChar("devEMF"))));
-            SEXP res = Rf_eval(call, R_GlobalEnv);
-            UNPROTECT(2);
-            if (!Rf_isVector(res)  ||  !Rf_isString(res)  ||
-                Rf_length(res) != 1) {
-                Rf_error("find.package failed to find devEMF install location"
-                         " (or uniquely identify location)");
-            }
-            packagePath = CHAR(STRING_ELT(res, 0));
+    static void x_InitAFMPathDB(void) {
+        if (afmPathDB.size() != 0) {
+            return;
+        }
+        afmPathDB["Courier"].push_back("Courier-ucs.afm");
+        afmPathDB["Courier"].push_back("Courier-Bold-ucs.afm");
+        afmPathDB["Courier"].push_back("Courier-Oblique-ucs.afm");
+        afmPathDB["Courier"].push_back("Courier-BoldOblique-ucs.afm");
+        afmPathDB["Helvetica"].push_back("Helvetica-ucs.afm");
+        afmPathDB["Helvetica"].push_back("Helvetica-Bold-ucs.afm");
+        afmPathDB["Helvetica"].push_back("Helvetica-Oblique-ucs.afm");
+        afmPathDB["Helvetica"].push_back("Helvetica-BoldOblique-ucs.afm");
+        afmPathDB["sans"] = afmPathDB["Helvetica"];
+        afmPathDB["Times"].push_back("Times-Roman-ucs.afm");
+        afmPathDB["Times"].push_back("Times-Bold-ucs.afm");
+        afmPathDB["Times"].push_back("Times-Italic-ucs.afm");
+        afmPathDB["Times"].push_back("Times-BoldItalic-ucs.afm");
+        afmPathDB["serif"] = afmPathDB["times"];
+        afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
+        afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
+        afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
+        afmPathDB["ZapfDingbats"].push_back("ZapfDingbats-ucs.afm");
+        afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
+        afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
+        afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
+        afmPathDB["Symbol"].push_back("Symbol-ucs.afm");
+    }
+    // package location is looked up (once per session) only when an
+    // AFM file is actually needed, since Xft usually supplies metrics
+    static const std::string& x_PackagePath(void) {
+        if (!packagePath.empty()) {
+            return packagePath;
         }
+        //find full path to package using R "findPackage" function
+        SEXP findPackage, call;
+        PROTECT(findPackage = Rf_findFun(Rf_install("find.package"),
+                                         R_GlobalEnv));
+        PROTECT(call = Rf_lang2(findPackage, Rf_ScalarString
+                                (Rf_mkChar("devEMF"))));
+        SEXP res = Rf_eval(call, R_GlobalEnv);
+        UNPROTECT(2);
+        if (!Rf_isVector(res)  ||  !Rf_isString(res)  ||
+            Rf_length(res) != 1) {
+            Rf_error("find.package failed to find devEMF install location"
+                     " (or uniquely identify location)");
+        }
+        packagePath = CHAR(STRING_ELT(res, 0));
+        return packagePath;
+    }
+    static bool x_HasAFM(const std::string &family, unsigned int face) {
+        return afmPathDB.find(family) != afmPathDB.end()  &&
+            afmPathDB[family].size() >= face;
+    }
+    static std::string x_AFMFile(const std::string &family, int face) {
+        return x_PackagePath() + "/afm/" + afmPathDB[family][face-1] + ".gz";
+    }
+#endif
+
+    // Parse built-in metrics for the given fonts ahead of time on a
+    // background thread (nothing that touches R or the X connection is
+    // done off the main thread).  Returns whether that was started:
+    // not with Xft, whose metrics are used instead, nor without zlib.
+    static bool Prewarm(const std::vector<SFontSpec> &specs) {
+#if defined(HAVE_ZLIB)  &&  !defined(HAVE_XFT)
+        x_InitAFMPathDB();
+        std::vector<std::string> files;
+        for (unsigned int i = 0;  i < specs.size();  ++i) {
+            unsigned int face = specs[i].m_Face;
+            files.push_back(x_AFMFile(x_HasAFM(specs[i].m_Family, face) ?
+                                      specs[i].m_Family : "Helvetica", face));
+            files.push_back(x_AFMFile("Symbol", face));
+            files.push_back(x_AFMFile("ZapfDingbats", face));
+        }
+        return s_AFMCache.Prewarm(files);
+#else
+        (void) specs;
+        return false;
+#endif
+    }
+
+    SSysFontInfo(const SFontSpec& spec) : m_Spec(spec) {
+#ifdef HAVE_ZLIB
+        x_InitAFMPathDB();
+        m_AFMExtrasLoaded = false;
 #endif
 #ifdef HAVE_XFT
         m_FontInfo = NULL;
-        if (!s_XDisplay) {
-            s_XDisplay = XOpenDisplay(NULL);
-            if (!s_XDisplay) {
+        if (!x_XDisplay()) {
 #ifndef HAVE_ZLIB
-                Rf_error("Can't open connection to X server to read font "
-                         "metric information (and devEMF was not compiled "
-                         "with zlib support to allow pulling metrics from "
-                         "file).");
+            Rf_error("Can't open connection to X server to read font "
+                     "metric information (and devEMF was not compiled "
+                     "with zlib support to allow pulling metrics from "
+                     "file).");
 #endif
-            }
         }
 #endif
 
@@ -222,30 +494,17 @@ struct SSysFontInfo {
         }
 #endif
 #ifdef HAVE_ZLIB
-        if (afmPathDB.find(m_Spec.m_Family) == afmPathDB.end()  ||
-            afmPathDB[m_Spec.m_Family].size() < m_Spec.m_Face) {
+        std::string afmFile;
+        if (!x_HasAFM(m_Spec.m_Family, m_Spec.m_Face)) {
             Rf_warning("Font metric information not found for family '%s'; "
                        "using 'Helvetica' instead", m_Spec.m_Family.c_str());
             //last-ditch substitute with "Helvetica"
-            LoadAFM((packagePath+"/afm/" +
-                     afmPathDB["Helvetica"][m_Spec.m_Face-1] + ".gz").
-                    c_str(), m_Spec.m_Size, true);
+            afmFile = x_AFMFile("Helvetica", m_Spec.m_Face);
         } else {
-            LoadAFM((packagePath+"/afm/" +
-                     afmPathDB[m_Spec.m_Family][m_Spec.m_Face-1] + ".gz").
-                    c_str(), m_Spec.m_Size, true);
-        }
-        //populate extra characters
-        if (m_Spec.m_Family != "Symbol") {
-            LoadAFM((packagePath+"/afm/" +
-                     afmPathDB["Symbol"][m_Spec.m_Face-1] + ".gz").
-                    c_str(), m_Spec.m_Size, false);
-        }
-        if (m_Spec.m_Family != "ZapfDingbats") {
-            LoadAFM((packagePath+"/afm/" +
-                     afmPathDB["ZapfDingbats"][m_Spec.m_Face-1] + ".gz").
-                    c_str(), m_Spec.m_Size, false);
+            afmFile = x_AFMFile(m_Spec.m_Family, m_Spec.m_Face);
         }
+        LoadFontBBox(afmFile, m_Spec.m_Size);
+        LoadAFM(afmFile);
 #endif
     }
 #ifdef HAVE_XFT
@@ -257,45 +516,44 @@ struct SSysFontInfo {
 #endif
 
 #ifdef HAVE_ZLIB
-    void LoadAFM(const std::string &filename, int size, bool loadFontBBox) {
-        const unsigned int buffsize = 512;
-        char buff[buffsize];
-        gzFile afm = gzopen(filename.c_str(), "rb");
-        while (gzgets(afm, buff, buffsize)) {
-            std::stringstream iss(buff);
-            std::string key;
-            iss >> key;
-            if (key == "FontBBox"  &&  loadFontBBox) {
-                iss >> m_AFMFontBBox.llx >> m_AFMFontBBox.lly
-                    >> m_AFMFontBBox.urx >> m_AFMFontBBox.ury;
-                m_AFMFontBBox.ascent = m_AFMFontBBox.ury * 0.001 * size;
-                m_AFMFontBBox.descent = m_AFMFontBBox.lly * 0.001 * size;
-                m_AFMFontBBox.width = (m_AFMFontBBox.urx-m_AFMFontBBox.llx)
-                    * 0.001 * size;
-            } else if (key == "C") {
-                SCharMetric cMetric;
-                iss >> std::hex >> cMetric.code >> std::dec >> key;
-                while (iss.good()) {
-                    if (key == "WX") {
-                        iss >> cMetric.w;
-                        cMetric.width = cMetric.w * 0.001 * size;
-                    } else if (key == "N") {
-                        iss >> cMetric.name;
-                    } else if (key == "B") {
-                        iss >> cMetric.llx >> cMetric.lly
-                            >> cMetric.urx >> cMetric.ury;
-                        cMetric.ascent = cMetric.ury * 0.001 * size;
-                        cMetric.descent = cMetric.lly * 0.001 * size;
-                    }
-                    iss >> key;
-                }
-                if (m_AFMCharMetrics.find(cMetric.code) ==
-                    m_AFMCharMetrics.end()) {
-                    m_AFMCharMetrics[cMetric.code] = cMetric;
-                }
+    void LoadFontBBox(const std::string &filename, int size) {
+        const SAFMFile &afm = s_AFMCache.Get(filename);
+        m_AFMFontBBox.ascent = afm.ury * 0.001 * size;
+        m_AFMFontBBox.descent = afm.lly * 0.001 * size;
+        m_AFMFontBBox.width = (afm.urx-afm.llx) * 0.001 * size;
+    }
+    void LoadAFM(const std::string &filename) const {
+        const SAFMFile &afm = s_AFMCache.Get(filename);
+        for (unsigned int i = 0;  i < afm.chars.size();  ++i) {
+            const SAFMFile::SChar &c = afm.chars[i];
+            SGlyphMetric *m = m_AFMCharMetrics.Insert(c.code);
+            if (m) {
+                m->width = c.w;
+                m->ascent = c.ury;
+                m->descent = c.lly;
             }
         }
-        gzclose(afm);
+    }
+    // returns true if there were extra fonts left to load
+    bool x_LoadAFMExtras(void) const {
+        if (m_AFMExtrasLoaded) {
+            return false;
+        }
+        m_AFMExtrasLoaded = true;
+        if (m_Spec.m_Family != "Symbol") {
+            LoadAFM(x_AFMFile("Symbol", m_Spec.m_Face));
+        }
+        if (m_Spec.m_Family != "ZapfDingbats") {
+            LoadAFM(x_AFMFile("ZapfDingbats", m_Spec.m_Face));
+        }
+        return true;
+    }
+    const SGlyphMetric* x_FindAFM(unsigned int c) const {
+        const SGlyphMetric *m = m_AFMCharMetrics.Find(c);
+        if (!m  &&  x_LoadAFMExtras()) {
+            m = m_AFMCharMetrics.Find(c);
+        }
+        return m;
     }
 #endif
 
@@ -303,13 +561,12 @@ struct SSysFontInfo {
 #ifdef HAVE_XFT
         if (m_FontInfo) {
             return XftCharExists(s_XDisplay, m_FontInfo, c);
-        } else {
-            return false;
         }
 #endif
 #ifdef HAVE_ZLIB
-        return m_AFMCharMetrics.find(c) != m_AFMCharMetrics.end();
+        return x_FindAFM(c) != NULL;
 #endif
+        return false;
     }
     
 #ifdef HAVE_FREETYPE
@@ -423,15 +680,15 @@ struct SSysFontInfo {
         }
 #endif
 #ifdef HAVE_ZLIB
-        TMetrics::const_iterator m= m_AFMCharMetrics.find(c);
-        if (m == m_AFMCharMetrics.end()) {
+        const SGlyphMetric *m = x_FindAFM(c);
+        if (!m) {
             ascent = 0;
             descent = 0;
             width = 0;
         } else {
-            ascent = m->second.ascent;
-            descent = m->second.descent;
-            width = m->second.width;
+            ascent = m->ascent * 0.001 * m_Spec.m_Size;
+            descent = m->descent * 0.001 * m_Spec.m_Size;
+            width = m->width * 0.001 * m_Spec.m_Size;
         }
 #endif
     }
@@ -439,28 +696,16 @@ struct SSysFontInfo {
 #ifdef HAVE_XFT
         if (m_FontInfo) {
 #ifdef HAVE_FREETYPE //freetype has kerning info
+            std::vector<unsigned int> str32;
+            x_UTF8toCodepoints(str, str32);
             double w = 0;
-            unsigned int length = strlen(str);
-            unsigned char len1, len2;
-            unsigned char arr[4];
-            unsigned long ch1, ch2;
-            len2 = UTF8codepointBytes(str[0]);
-            memset(arr, 0, 4); memcpy(arr + 4-len2, str, len2);
-            arr[4-len2] &= 255 >> len2;
-            ch2 = (arr[0] & 63) << 18  | (arr[1] & 63) << 12 | (arr[2] & 63) << 6 | arr[3] & 127;
             unsigned int i;
-            for (i = 0;  i+len2 < length;  i += len1) {
-                len1 = len2;
-                len2 = UTF8codepointBytes(str[i+len1]);
-                ch1 = ch2;
-                memset(arr, 0, 4); memcpy(arr + 4-len2, str+i+len1, len2);
-                arr[4-len2] &= 255 >> len2;
-                ch2 = (arr[0] & 63) << 18  | (arr[1] & 63) << 12 | (arr[2] & 63) << 6 | arr[3] & 127;
-                w += GetAdvance(ch1, ch2);
+            for (i = 0;  i+1 < str32.size();  ++i) {
+                w += GetAdvance(str32[i], str32[i+1]);
             }
-            if (i < length) {//last width
+            if (i < str32.size()) {//last width
                 XGlyphInfo extents;
-                FcChar32 c = ch2;
+                FcChar32 c = str32[i];
                 XftTextExtents32(s_XDisplay, m_FontInfo, &c, 1, &extents);
                 w += extents.xOff;
             }
@@ -474,36 +719,15 @@ struct SSysFontInfo {
         }
 #endif
 #ifdef HAVE_ZLIB
-        void *cd = Riconv_open("UCS-2", "UTF-8");
-        if (cd == (void*)(-1)) {
-            Rf_error("EMF device failed to convert UTF-8 to UCS-2");
-            return 0;
-        }
-        size_t inLeft = strlen(str);
-        const char *in = str;
-        size_t outLeft = inLeft*2;//overestimate
-        char *ucs2Str = new char[outLeft];
-        char *out = ucs2Str;
-        size_t res = Riconv(cd, &in, &inLeft, &out, &outLeft);
-        if (res != 0) {
-            Riconv_close(cd);
-            Rf_error("Text string not valid UTF-8");
-            delete[] ucs2Str;
-            return 0;
+        std::vector<unsigned int> str32;
+        x_UTF8toCodepoints(str, str32);
+        bool missing;
+        double w = m_AFMCharMetrics.SumWidths(str32.data(), str32.size(),
+                                              m_Spec.m_Size, missing);
+        if (missing  &&  x_LoadAFMExtras()) {
+            w = m_AFMCharMetrics.SumWidths(str32.data(), str32.size(),
+                                           m_Spec.m_Size, missing);
         }
-        Riconv_close(cd);
-
-        double w = 0;
-        unsigned int len = strlen(str)*2 - outLeft;
-        for (unsigned int i = 0;  i < len;  i += 2) {
-            int c = ((unsigned char) ucs2Str[i]) +
-                (((unsigned char) ucs2Str[i+1]) << 8);
-            TMetrics::const_iterator m= m_AFMCharMetrics.find(c);
-            if (m != m_AFMCharMetrics.end()) {
-                w += m->second.width;
-            }
-        }
-        delete[] ucs2Str;
         return w;
 #endif
     }
@@ -526,8 +750,10 @@ struct SSysFontInfo {
 };
 #ifdef HAVE_XFT
 Display* SSysFontInfo::s_XDisplay = NULL; //global connection to X server
+bool SSysFontInfo::s_XDisplayTried = false;
 #endif
 #ifdef HAVE_ZLIB
+SSysFontInfo::CAFMCache SSysFontInfo::s_AFMCache;
 std::map<std::string, std::vector<std::string> > SSysFontInfo::afmPathDB;
 std::string SSysFontInfo::packagePath;
 #endif
@@ -549,6 +775,10 @@ std::string SSysFontInfo::packagePath;
     typedef std::map<SCharPair, int> TKerningTable;
     mutable TKerningTable m_KerningTable;
 
+    // metrics are queried directly from the OS; nothing to load ahead
+    // of time
+    static bool Prewarm(const std::vector<SFontSpec> &) { return false; }
+
     SSysFontInfo(const SFontSpec& spec) : m_Spec(spec) {
         m_DC = GetDC(0);
         LOGFONT lf;
@@ -715,6 +945,10 @@ std::string SSysFontInfo::packagePath;
 #ifdef __APPLE__
     CTFontRef m_FontInfo;
 
+    // metrics are queried directly from the OS; nothing to load ahead
+    // of time
+    static bool Prewarm(const std::vector<SFontSpec> &) { return false; }
+
     SSysFontInfo(const SFontSpec& spec) : m_Spec(spec) {
         CFMutableDictionaryRef attr =
             CFDictionaryCreateMutable(NULL, 1, &kCFTypeDictionaryKeyCallBacks,
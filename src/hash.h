@@ -0,0 +1,104 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains a fast 64-bit content hash (following the
+    structure of xxHash64) used to recognize repeated data, such as the
+    same raster image drawn more than once.  Not for cryptographic use.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef HASH__H
+#define HASH__H
+
+#include <stddef.h>
+
+namespace HASH {
+    typedef unsigned long long TUInt8;
+
+    const TUInt8 kPrime1 = 0x9E3779B185EBCA87ULL;
+    const TUInt8 kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    const TUInt8 kPrime3 = 0x165667B19E3779F9ULL;
+    const TUInt8 kPrime4 = 0x85EBCA77C2B2AE63ULL;
+    const TUInt8 kPrime5 = 0x27D4EB2F165667C5ULL;
+
+    inline TUInt8 x_Rotl(TUInt8 x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+    inline TUInt8 x_Round(TUInt8 acc, TUInt8 input) {
+        return x_Rotl(acc + input*kPrime2, 31) * kPrime1;
+    }
+    // (little-endian on all platforms, as hashes are stored in files
+    // and compared across runs and machines)
+    inline TUInt8 x_Read8(const unsigned char *p) {
+        TUInt8 v = 0;
+        for (int i = 7;  i >= 0;  --i) {
+            v = (v << 8) | p[i];
+        }
+        return v;
+    }
+
+    // Hash of len bytes at data
+    inline TUInt8 Hash64(const void *data, size_t len, TUInt8 seed = 0) {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        const unsigned char *end = p + len;
+        TUInt8 h;
+        if (len >= 32) {
+            // four independent lanes keep the multipliers busy
+            TUInt8 v1 = seed + kPrime1 + kPrime2;
+            TUInt8 v2 = seed + kPrime2;
+            TUInt8 v3 = seed;
+            TUInt8 v4 = seed - kPrime1;
+            for (;  end - p >= 32;  p += 32) {
+                v1 = x_Round(v1, x_Read8(p));
+                v2 = x_Round(v2, x_Read8(p+8));
+                v3 = x_Round(v3, x_Read8(p+16));
+                v4 = x_Round(v4, x_Read8(p+24));
+            }
+            h = x_Rotl(v1, 1) + x_Rotl(v2, 7) + x_Rotl(v3, 12) +
+                x_Rotl(v4, 18);
+            h = (h ^ x_Round(0, v1)) * kPrime1 + kPrime4;
+            h = (h ^ x_Round(0, v2)) * kPrime1 + kPrime4;
+            h = (h ^ x_Round(0, v3)) * kPrime1 + kPrime4;
+            h = (h ^ x_Round(0, v4)) * kPrime1 + kPrime4;
+        } else {
+            h = seed + kPrime5;
+        }
+        h += len;
+        for (;  end - p >= 8;  p += 8) {
+            h = x_Rotl(h ^ x_Round(0, x_Read8(p)), 27) * kPrime1 + kPrime4;
+        }
+        for (;  p < end;  ++p) {
+            h = x_Rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+        }
+        h ^= h >> 33;
+        h *= kPrime2;
+        h ^= h >> 29;
+        h *= kPrime3;
+        h ^= h >> 32;
+        return h;
+    }
+} //end of HASH namespace
+
+#endif //HASH__H
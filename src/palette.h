@@ -0,0 +1,131 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains detection of rasters with few enough colors
+    to be stored as indexed (palette) bitmaps.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef PALETTE__H
+#define PALETTE__H
+
+#include <vector>
+#include <string.h>
+#include <stddef.h>
+
+class CPalette {
+public:
+    enum { kMaxColors = 256 };
+
+    CPalette(void) : m_Mask(0xFFFFFFFF) {}
+
+    // Collect the distinct colors of data (after masking each with
+    // mask, e.g. to ignore alpha).  Returns false as soon as more than
+    // kMaxColors are found.
+    bool Build(const unsigned int *data, size_t n,
+               unsigned int mask = 0xFFFFFFFF) {
+        m_Mask = mask;
+        m_Colors.clear();
+        memset(m_Slots, 0, sizeof(m_Slots));
+        unsigned int last = 0;
+        for (size_t i = 0;  i < n;  ++i) {
+            unsigned int c = data[i] & mask;
+            if (i > 0  &&  c == last) {
+                continue; //runs are common (e.g., image() cells)
+            }
+            last = c;
+            unsigned int s = x_Slot(c);
+            if (!m_Slots[s]) {
+                if (m_Colors.size() == kMaxColors) {
+                    return false;
+                }
+                m_Colors.push_back(c);
+                m_Slots[s] = m_Colors.size();
+            }
+        }
+        return true;
+    }
+
+    unsigned int Size(void) const { return m_Colors.size(); }
+    unsigned int operator[](unsigned int i) const { return m_Colors[i]; }
+
+    // index of (unmasked) color c, which must have been in the data
+    unsigned char Index(unsigned int c) const {
+        return m_Slots[x_Slot(c & m_Mask)] - 1;
+    }
+
+    // smallest bits per pixel (of 1, 2, 4, 8) that can index the
+    // palette; pass allow2 = false for formats lacking 2bpp (e.g., DIBs)
+    unsigned int BitDepth(bool allow2 = true) const {
+        if (m_Colors.size() <= 2) {
+            return 1;
+        } else if (m_Colors.size() <= 4  &&  allow2) {
+            return 2;
+        } else if (m_Colors.size() <= 16) {
+            return 4;
+        }
+        return 8;
+    }
+
+    // Pack the palette indices of n pixels at bitDepth bits each (most
+    // significant bits first, as both PNG and DIBs expect) into out.
+    void PackRow(const unsigned int *data, unsigned int n,
+                 unsigned int bitDepth, unsigned char *out) const {
+        if (bitDepth == 8) {
+            for (unsigned int i = 0;  i < n;  ++i) {
+                out[i] = Index(data[i]);
+            }
+            return;
+        }
+        const unsigned int perByte = 8 / bitDepth;
+        for (unsigned int i = 0;  i < n;  i += perByte) {
+            unsigned char b = 0;
+            for (unsigned int j = 0;  j < perByte;  ++j) {
+                b <<= bitDepth;
+                if (i + j < n) {
+                    b |= Index(data[i+j]);
+                }
+            }
+            out[i / perByte] = b;
+        }
+    }
+
+private:
+    enum { kSlotBits = 12 }; //open addressing table, <= 1/16 full
+    // slot holding c (if present) or the empty slot where it belongs
+    unsigned int x_Slot(unsigned int c) const {
+        unsigned int s = (c * 0x9E3779B1u) >> (32 - kSlotBits);
+        while (m_Slots[s]  &&  m_Colors[m_Slots[s]-1] != c) {
+            s = (s + 1) & ((1 << kSlotBits) - 1);
+        }
+        return s;
+    }
+
+    unsigned int m_Mask;
+    std::vector<unsigned int> m_Colors;
+    unsigned short m_Slots[1 << kSlotBits]; //palette index + 1; 0 if empty
+};
+
+#endif //PALETTE__H
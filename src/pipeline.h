@@ -0,0 +1,216 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+
+    This header contains the command queue used to draw on a worker
+    thread: graphics callbacks copy their arguments (and the few
+    graphics context fields drawing needs) into a compact command,
+    and the worker builds and writes the records.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef PIPELINE__H
+#define PIPELINE__H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <exception>
+#include <string.h>
+
+#include <R_ext/GraphicsEngine.h>
+
+namespace PIPELINE {
+    enum EType {
+        eLine, ePolyline, ePolygon, ePath, eRect, eCircle, eRaster, eClip
+    };
+
+    // The graphics context fields used for drawing shapes
+    struct SGC {
+        int col, fill, lty;
+        double lwd, lmitre;
+        R_GE_lineend lend;
+        R_GE_linejoin ljoin;
+        void Set(const pGEcontext gc) {
+            col = gc->col;
+            fill = gc->fill;
+            lty = gc->lty;
+            lwd = gc->lwd;
+            lmitre = gc->lmitre;
+            lend = gc->lend;
+            ljoin = gc->ljoin;
+        }
+        // a full graphics context with these fields (and no pattern)
+        void Get(R_GE_gcontext &gc) const {
+            memset(&gc, 0, sizeof(gc));
+            gc.col = col;
+            gc.fill = fill;
+            gc.lty = lty;
+            gc.lwd = lwd;
+            gc.lmitre = lmitre;
+            gc.lend = lend;
+            gc.ljoin = ljoin;
+            gc.cex = 1;
+            gc.ps = 12;
+            gc.lineheight = 1;
+#if R_GE_version >= 13
+            gc.patternFill = R_NilValue;
+#endif
+        }
+    };
+
+    struct SCommand {
+        EType type;
+        SGC gc;
+        double v[7];         //scalar arguments, in callback order
+        int i[3];            //sizes or flags, in callback order
+        std::vector<double> x, y;
+        std::vector<int> n;  //points per polygon (paths)
+        std::vector<unsigned int> pixels;
+
+        void Points(int count, const double *xs, const double *ys) {
+            x.assign(xs, xs + count);
+            y.assign(ys, ys + count);
+        }
+        size_t Size(void) const {
+            return sizeof(*this) + (x.size() + y.size())*sizeof(double) +
+                n.size()*sizeof(int) + pixels.size()*sizeof(unsigned int);
+        }
+    };
+
+    // Runs commands in order on a worker thread.  At most kMaxQueued
+    // bytes of commands wait at any time (further commands block until
+    // the worker catches up).  Warnings raised by the worker are kept
+    // for the R thread to pass on.
+    class CWorker {
+    public:
+        typedef std::function<void(SCommand&)> TRun;
+        CWorker(const TRun &run) : m_Run(run), m_Stop(false), m_Queued(0) {
+            try {
+                m_Thread = std::thread(&CWorker::x_Loop, this);
+            } catch (const std::system_error &) {
+                // no thread to be had; run commands as they come
+            }
+        }
+        ~CWorker(void) { Stop(); }
+
+        void Push(SCommand &c) {
+            if (!m_Thread.joinable()) {
+                x_Run(c);
+                return;
+            }
+            size_t size = c.Size();
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Cond.wait(lock, [this]() { return m_Queued < kMaxQueued; });
+            m_Queued += size;
+            m_Commands.push_back(std::move(c));
+            lock.unlock();
+            m_Cond.notify_all();
+        }
+        // Wait until all commands have run
+        void Drain(void) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Cond.wait(lock, [this]() { return m_Queued == 0; });
+        }
+        void Stop(void) {
+            Drain();
+            if (m_Thread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_Stop = true;
+                }
+                m_Cond.notify_all();
+                m_Thread.join();
+            }
+        }
+
+        void Warn(const char *msg) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Warnings.push_back(msg);
+        }
+        // warnings raised since the last call
+        std::vector<std::string> TakeWarnings(void) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            std::vector<std::string> w;
+            w.swap(m_Warnings);
+            return w;
+        }
+        // worker running on this thread, if any
+        static CWorker*& Current(void) {
+            static thread_local CWorker *current = NULL;
+            return current;
+        }
+
+    private:
+        enum { kMaxQueued = 1 << 24 };
+
+        void x_Run(SCommand &c) {
+            CWorker *prev = Current();
+            Current() = this; //also when run on the R thread, for Warn
+            try {
+                m_Run(c);
+            } catch (const std::exception &e) {
+                Warn((std::string("devEMF: drawing failed: ") +
+                      e.what()).c_str());
+            }
+            Current() = prev;
+        }
+        void x_Loop(void) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            while (true) {
+                m_Cond.wait(lock, [this]() {
+                        return m_Stop  ||  !m_Commands.empty();
+                    });
+                if (m_Commands.empty()) {
+                    return; //stopped
+                }
+                SCommand c = std::move(m_Commands.front());
+                m_Commands.pop_front();
+                lock.unlock();
+                size_t size = c.Size();
+                x_Run(c);
+                lock.lock();
+                m_Queued -= size;
+                m_Cond.notify_all();
+            }
+        }
+
+        TRun m_Run;
+        std::thread m_Thread;
+        std::mutex m_Mutex;
+        std::condition_variable m_Cond;
+        bool m_Stop;
+        std::deque<SCommand> m_Commands;
+        size_t m_Queued; //bytes of commands not yet run
+        std::vector<std::string> m_Warnings;
+    };
+} //end of PIPELINE namespace
+
+#endif //PIPELINE__H
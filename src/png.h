@@ -0,0 +1,376 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains a minimal PNG encoder for R raster data (used
+    for compressed EMF+ bitmap objects).  Rows are filtered and
+    deflated one at a time, so no filtered copy of the image is kept.
+    Images with few colors are written as palette images, and large
+    images are compressed in bands of rows on several threads.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef PNG__H
+#define PNG__H
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "palette.h"
+#include "workers.h"
+
+namespace PNG {
+    inline void x_PutUInt4BE(unsigned char *p, unsigned int v) {
+        p[0] = (v >> 24) & 0xFF;
+        p[1] = (v >> 16) & 0xFF;
+        p[2] = (v >> 8) & 0xFF;
+        p[3] = v & 0xFF;
+    }
+    inline void x_AppendUInt4BE(std::string &o, unsigned int v) {
+        unsigned char b[4];
+        x_PutUInt4BE(b, v);
+        o.append(reinterpret_cast<const char*>(b), 4);
+    }
+
+    // Append a chunk with the given 4 character type and data
+    inline void x_AppendChunk(std::string &o, const char *type,
+                              const unsigned char *data, unsigned int len) {
+        x_AppendUInt4BE(o, len);
+        o.append(type, 4);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+        if (len > 0) { //note crc32() treats NULL data as a reset
+            o.append(reinterpret_cast<const char*>(data), len);
+            crc = crc32(crc, data, len);
+        }
+        x_AppendUInt4BE(o, crc);
+    }
+
+    inline unsigned char x_Paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        return (pa <= pb  &&  pa <= pc) ? a : (pb <= pc ? b : c);
+    }
+
+    // Filter row (bpp bytes per pixel; prev is NULL for the first row)
+    // with each of the five PNG filters and store the one with the
+    // smallest sum of absolute (signed) values in out, preceded by its
+    // filter type byte.  This is the usual libpng heuristic.
+    inline void x_FilterRow(const unsigned char *row, const unsigned char *prev,
+                            unsigned int len, unsigned int bpp,
+                            std::vector<unsigned char> &cand,
+                            std::vector<unsigned char> &out) {
+        cand.resize(5*len);
+        unsigned long best = (unsigned long)-1;
+        unsigned int bestType = 0;
+        for (unsigned int type = 0;  type < 5;  ++type) {
+            unsigned char *f = &cand[type*len];
+            unsigned long sum = 0;
+            for (unsigned int i = 0;  i < len;  ++i) {
+                int a = i >= bpp ? row[i-bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                int c = (prev  &&  i >= bpp) ? prev[i-bpp] : 0;
+                switch (type) {
+                case 0: f[i] = row[i]; break;
+                case 1: f[i] = row[i] - a; break;
+                case 2: f[i] = row[i] - b; break;
+                case 3: f[i] = row[i] - ((a + b) >> 1); break;
+                case 4: f[i] = row[i] - x_Paeth(a, b, c); break;
+                }
+                sum += f[i] < 128 ? f[i] : 256 - f[i];
+            }
+            if (sum < best) {
+                best = sum;
+                bestType = type;
+            }
+        }
+        out[0] = bestType;
+        std::copy(cand.begin() + bestType*len, cand.begin() + (bestType+1)*len,
+                  out.begin() + 1);
+    }
+
+    // Rows of R raster data (colors packed as 0xAABBGGRR) as 8-bit RGBA
+    struct SRGBARows {
+        const unsigned int *data;
+        unsigned int w;
+        void Row(unsigned int y, unsigned char *row) const {
+            const unsigned int *src = data + (size_t)y*w;
+            for (unsigned int x = 0;  x < w;  ++x) {
+                row[4*x+0] = src[x] & 0xFF;
+                row[4*x+1] = (src[x] >> 8) & 0xFF;
+                row[4*x+2] = (src[x] >> 16) & 0xFF;
+                row[4*x+3] = (src[x] >> 24) & 0xFF;
+            }
+        }
+    };
+    // Rows of R raster data as packed palette indices
+    struct SIndexedRows {
+        const unsigned int *data;
+        unsigned int w;
+        const CPalette *pal;
+        unsigned int bitDepth;
+        void Row(unsigned int y, unsigned char *row) const {
+            pal->PackRow(data + (size_t)y*w, w, bitDepth, row);
+        }
+    };
+
+    // Filtered rows (each preceded by its filter type byte) of rowLen
+    // bytes from src.  Rows must be requested in order, but may start
+    // at any row.  Rows are filtered if filter is true (bpp bytes per
+    // pixel; palette images are better left unfiltered).
+    template<class TRows>
+    struct SRowFilter {
+        const TRows &src;
+        unsigned int rowLen, bpp;
+        bool filter;
+        std::vector<unsigned char> rows[2], cand, filtered;
+        SRowFilter(const TRows &s, unsigned int len, unsigned int b,
+                   bool f) : src(s), rowLen(len), bpp(b), filter(f),
+                             filtered(len+1) {
+            rows[0].resize(rowLen);
+            rows[1].resize(rowLen);
+        }
+        // filtered row y; first is true if row y-1 was not just requested
+        const unsigned char* Row(unsigned int y, bool first) {
+            unsigned char *row = &rows[y & 1][0];
+            unsigned char *prev = y > 0 ? &rows[(y-1) & 1][0] : NULL;
+            if (first  &&  prev  &&  filter) {
+                src.Row(y-1, prev);
+            }
+            src.Row(y, row);
+            if (filter) {
+                x_FilterRow(row, prev, rowLen, bpp, cand, filtered);
+            } else {
+                filtered[0] = 0;
+                std::copy(row, row + rowLen, filtered.begin() + 1);
+            }
+            return &filtered[0];
+        }
+    };
+
+    // Append IDAT chunk(s) holding h rows of rowLen bytes from src to
+    // o as a single deflate stream.
+    template<class TRows>
+    bool x_AppendImageData(std::string &o, const TRows &src,
+                           unsigned int rowLen, unsigned int h,
+                           unsigned int bpp, bool filter) {
+        const unsigned int kChunkSize = 1 << 16;
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return false;
+        }
+        SRowFilter<TRows> rows(src, rowLen, bpp, filter);
+        std::vector<unsigned char> idat(kChunkSize);
+        zs.next_out = &idat[0];
+        zs.avail_out = kChunkSize;
+        int ret = Z_OK;
+        for (unsigned int y = 0;  y <= h  &&  ret != Z_STREAM_END;  ++y) {
+            if (y < h) {
+                zs.next_in = const_cast<Bytef*>(rows.Row(y, y == 0));
+                zs.avail_in = rowLen+1;
+            }
+            int flush = y < h ? Z_NO_FLUSH : Z_FINISH;
+            do {
+                ret = deflate(&zs, flush);
+                if (ret == Z_STREAM_ERROR) {
+                    deflateEnd(&zs);
+                    return false;
+                }
+                if (zs.avail_out == 0  ||  ret == Z_STREAM_END) {
+                    x_AppendChunk(o, "IDAT", &idat[0],
+                                  kChunkSize - zs.avail_out);
+                    zs.next_out = &idat[0];
+                    zs.avail_out = kChunkSize;
+                }
+            } while (zs.avail_in > 0  ||
+                     (flush == Z_FINISH  &&  ret != Z_STREAM_END));
+        }
+        deflateEnd(&zs);
+        return true;
+    }
+
+    // Independently compressed run of rows [y0, y1) of an image: raw
+    // deflate data ending on a byte boundary (or, for the last band,
+    // the end of the stream), so that bands can simply be concatenated
+    struct SBand {
+        unsigned int y0, y1;
+        bool last;
+        std::string z;
+        uLong adler; //of the filtered rows
+        bool ok;
+        template<class TRows>
+        void Deflate(const TRows &src, unsigned int rowLen,
+                     unsigned int bpp, bool filter) {
+            const unsigned int kOutSize = 1 << 16;
+            ok = false;
+            adler = adler32(0, NULL, 0);
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                             -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return;
+            }
+            SRowFilter<TRows> rows(src, rowLen, bpp, filter);
+            unsigned char out[kOutSize];
+            for (unsigned int y = y0;  y < y1;  ++y) {
+                zs.next_in = const_cast<Bytef*>(rows.Row(y, y == y0));
+                zs.avail_in = rowLen+1;
+                adler = adler32(adler, zs.next_in, zs.avail_in);
+                int flush = y+1 < y1 ? Z_NO_FLUSH :
+                    (last ? Z_FINISH : Z_SYNC_FLUSH);
+                do {
+                    zs.next_out = out;
+                    zs.avail_out = kOutSize;
+                    if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+                        deflateEnd(&zs);
+                        return;
+                    }
+                    z.append(reinterpret_cast<const char*>(out),
+                             kOutSize - zs.avail_out);
+                } while (zs.avail_out == 0);
+            }
+            deflateEnd(&zs);
+            ok = true;
+        }
+    };
+
+    // As x_AppendImageData, but compressing bands of rows in parallel
+    // on up to maxThreads threads (0 for one per core) and stitching
+    // them into one zlib stream.  The band split depends only on the
+    // image, so output does not depend on the number of threads.
+    template<class TRows>
+    bool x_AppendImageDataBands(std::string &o, const TRows &src,
+                                unsigned int rowLen, unsigned int h,
+                                unsigned int bpp, bool filter,
+                                unsigned int maxThreads) {
+        // bands cost a few bytes each and restart the deflate window,
+        // so keep them large
+        const unsigned int kBandSize = 1 << 21;
+        unsigned int bandRows = std::max(1u, kBandSize/(rowLen+1));
+        unsigned int nBands = (h + bandRows - 1)/bandRows;
+        if (nBands < 2) {
+            return x_AppendImageData(o, src, rowLen, h, bpp, filter);
+        }
+        std::vector<SBand> bands(nBands);
+        for (unsigned int i = 0;  i < nBands;  ++i) {
+            bands[i].y0 = i*bandRows;
+            bands[i].y1 = std::min(h, (i+1)*bandRows);
+            bands[i].last = i+1 == nBands;
+        }
+        WORKERS::ParallelFor(nBands, WORKERS::Count(maxThreads, nBands),
+                             [&](unsigned int i) {
+                                 bands[i].Deflate(src, rowLen, bpp, filter);
+                             });
+
+        std::string z("\x78\x9C", 2); //zlib header (32K window, default level)
+        uLong adler = adler32(0, NULL, 0);
+        for (unsigned int i = 0;  i < nBands;  ++i) {
+            if (!bands[i].ok) {
+                return false;
+            }
+            z.append(bands[i].z);
+            std::string().swap(bands[i].z);
+            adler = adler32_combine(adler, bands[i].adler,
+                                    (z_off_t)(bands[i].y1 - bands[i].y0) *
+                                    (rowLen+1));
+        }
+        x_AppendUInt4BE(z, adler);
+
+        const unsigned int kChunkSize = 1 << 16;
+        for (size_t i = 0;  i < z.size();  i += kChunkSize) {
+            x_AppendChunk(o, "IDAT",
+                          reinterpret_cast<const unsigned char*>(z.data()+i),
+                          std::min((size_t)kChunkSize, z.size() - i));
+        }
+        return true;
+    }
+
+    // Append a PNG encoding of the w x h R raster data (colors packed
+    // as 0xAABBGGRR, rows from the top) to o.  Images with at most 256
+    // colors are stored as palette images; others as 8-bit RGBA.
+    // Large images are compressed on up to maxThreads threads (0 for
+    // one per core).  Returns false (leaving o unchanged) if zlib fails.
+    inline bool Encode(std::string &o, const unsigned int *data,
+                       unsigned int w, unsigned int h,
+                       unsigned int maxThreads = 1) {
+        size_t start = o.size();
+        static const unsigned char sig[8] =
+            {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        o.append(reinterpret_cast<const char*>(sig), 8);
+
+        CPalette pal;
+        bool indexed = pal.Build(data, (size_t)w*h);
+        unsigned int bitDepth = indexed ? pal.BitDepth() : 8;
+
+        unsigned char ihdr[13];
+        x_PutUInt4BE(ihdr, w);
+        x_PutUInt4BE(ihdr+4, h);
+        ihdr[8] = bitDepth;
+        ihdr[9] = indexed ? 3 : 6; //color type: palette or RGBA
+        ihdr[10] = ihdr[11] = ihdr[12] = 0; //deflate, adaptive, no interlace
+        x_AppendChunk(o, "IHDR", ihdr, 13);
+
+        bool ok;
+        if (indexed) {
+            std::vector<unsigned char> plte(3*pal.Size()), trns(pal.Size());
+            unsigned int nTrns = 0;
+            for (unsigned int i = 0;  i < pal.Size();  ++i) {
+                plte[3*i+0] = pal[i] & 0xFF;
+                plte[3*i+1] = (pal[i] >> 8) & 0xFF;
+                plte[3*i+2] = (pal[i] >> 16) & 0xFF;
+                trns[i] = pal[i] >> 24;
+                if (trns[i] != 0xFF) {
+                    nTrns = i+1; //trailing opaque entries can be omitted
+                }
+            }
+            x_AppendChunk(o, "PLTE", &plte[0], plte.size());
+            if (nTrns > 0) {
+                x_AppendChunk(o, "tRNS", &trns[0], nTrns);
+            }
+            SIndexedRows src = {data, w, &pal, bitDepth};
+            ok = x_AppendImageDataBands(o, src, (w*bitDepth + 7)/8, h, 1,
+                                        false, maxThreads);
+        } else {
+            SRGBARows src = {data, w};
+            ok = x_AppendImageDataBands(o, src, 4*w, h, 4, true, maxThreads);
+        }
+        if (!ok) {
+            o.resize(start);
+            return false;
+        }
+        x_AppendChunk(o, "IEND", NULL, 0);
+        return true;
+    }
+} //end of PNG namespace
+
+#endif //HAVE_ZLIB
+#endif //PNG__H
@@ -0,0 +1,154 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains detection of borderless rectangles tiling a
+    regular grid (as drawn by image() without useRaster), so that they
+    can be output as a single raster image.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef RECTGRID__H
+#define RECTGRID__H
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+class CRectGrid {
+public:
+    struct SRect {
+        double x0, y0, x1, y1;
+        unsigned int fill;
+        int col, row; //grid cell, relative to the first (set by Add)
+    };
+
+    CRectGrid(void) { Clear(); }
+    void Clear(void) {
+        m_Rects.clear();
+        m_NOpaque = 0;
+        m_NCol = 0;
+        m_MinRow = m_MaxRow = 0;
+    }
+    bool Empty(void) const { return m_Rects.empty(); }
+    const std::vector<SRect>& Rects(void) const { return m_Rects; }
+
+    // Add r if it is the same size as the previous rectangles and in
+    // a later cell of their grid (by column, then row, as image()
+    // draws them; skipped cells, e.g. for NA values, are left
+    // transparent in the raster).  Returns false (leaving the grid unchanged) if not.
+    bool Add(SRect r) {
+        if (m_Rects.empty()) {
+            if (r.x1 == r.x0  ||  r.y1 == r.y0) {
+                return false;
+            }
+            m_X = r.x0;
+            m_Y = r.y0;
+            m_DX = r.x1 - r.x0;
+            m_DY = r.y1 - r.y0;
+            r.col = r.row = 0;
+        } else {
+            const SRect &last = m_Rects.back();
+            if (!x_Near(r.x1 - r.x0, m_DX, m_DX)  ||
+                !x_Near(r.y1 - r.y0, m_DY, m_DY)  ||
+                !x_Cell(r.x0, m_X, m_DX, r.col)  ||
+                !x_Cell(r.y0, m_Y, m_DY, r.row)  ||
+                r.col < last.col  ||
+                (r.col == last.col  &&  r.row <= last.row)) {
+                return false;
+            }
+        }
+        m_Rects.push_back(r);
+        if ((r.fill >> 24) == 0xFF) { //as R_OPAQUE
+            ++m_NOpaque;
+        }
+        m_NCol = r.col + 1;
+        m_MinRow = std::min(m_MinRow, r.row);
+        m_MaxRow = std::max(m_MaxRow, r.row);
+        return true;
+    }
+
+    // whether the rectangles form a grid large and dense enough to be
+    // worth drawing as a raster.  Unless the raster keeps its alpha
+    // channel, the grid must be complete and opaque, as missing and
+    // translucent cells would otherwise come out solid.
+    bool IsRaster(bool keepsAlpha) const {
+        double nRow = m_MaxRow - m_MinRow + 1;
+        if (!keepsAlpha  &&  (m_NOpaque < m_Rects.size()  ||
+                              m_Rects.size() < m_NCol*nRow)) {
+            return false;
+        }
+        return m_NCol >= 2  &&  nRow >= 2  &&  m_Rects.size() >= kMinCells  &&
+            2*m_Rects.size() >= m_NCol*nRow;
+    }
+
+    // Raster of the grid (one pixel per cell, rows from the top, as R
+    // passes rasters to devices) and its position in device
+    // coordinates (x, y being the bottom left corner)
+    void GetRaster(std::vector<unsigned int> &pixels, int &w, int &h,
+                   double &x, double &y, double &width,
+                   double &height) const {
+        w = m_NCol;
+        h = m_MaxRow - m_MinRow + 1;
+        pixels.assign((size_t)w*h, 0); //transparent
+        for (size_t i = 0;  i < m_Rects.size();  ++i) {
+            const SRect &r = m_Rects[i];
+            int row = r.row - m_MinRow;
+            int px = m_DX > 0 ? r.col : w - 1 - r.col;
+            int py = m_DY > 0 ? h - 1 - row : row;
+            pixels[(size_t)py*w + px] = r.fill;
+        }
+        // (x, y) is the bottom left of cell (0, 0) if both sizes are
+        // positive; otherwise it is at the opposite edge of the grid
+        double y0 = m_Y + m_MinRow*m_DY;
+        x = m_DX > 0 ? m_X : m_X + w*m_DX;
+        y = m_DY > 0 ? y0 : y0 + h*m_DY;
+        width = w*fabs(m_DX);
+        height = h*fabs(m_DY);
+    }
+
+private:
+    enum { kMinCells = 64 };
+    // allowed error (relative to the cell size) in tiling the grid
+    static double x_Tol(double size) { return 1e-3*fabs(size); }
+    static bool x_Near(double a, double b, double size) {
+        return fabs(a - b) <= x_Tol(size);
+    }
+    // index of the cell starting at v (if on the grid)
+    static bool x_Cell(double v, double origin, double size, int &i) {
+        double d = floor((v - origin)/size + 0.5);
+        if (fabs(d) > 1e6  ||  !x_Near(v, origin + d*size, size)) {
+            return false;
+        }
+        i = d;
+        return true;
+    }
+
+    std::vector<SRect> m_Rects;
+    size_t m_NOpaque; //rectangles with an opaque fill
+    double m_X, m_Y, m_DX, m_DY; //grid origin and cell size
+    int m_NCol, m_MinRow, m_MaxRow;
+};
+
+#endif //RECTGRID__H
@@ -0,0 +1,147 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains downsampling of R raster data (colors packed
+    as 0xAABBGGRR), used to avoid embedding rasters at a resolution far
+    beyond that of the output.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef RESAMPLE__H
+#define RESAMPLE__H
+
+#include <vector>
+
+#include "workers.h"
+
+namespace RESAMPLE {
+    // Source pixel span [begin, end) covered by each of n destination
+    // pixels along an axis of srcN source pixels (srcN >= n)
+    inline void x_Spans(unsigned int srcN, unsigned int n,
+                        std::vector<unsigned int> &begin,
+                        std::vector<unsigned int> &end) {
+        begin.resize(n);
+        end.resize(n);
+        for (unsigned int i = 0;  i < n;  ++i) {
+            begin[i] = (unsigned long long)i*srcN/n;
+            end[i] = (unsigned long long)(i+1)*srcN/n;
+        }
+    }
+
+    struct SJob {
+        const unsigned int *src;
+        unsigned int srcW;
+        unsigned int *dst;
+        unsigned int w;
+        bool box;
+        std::vector<unsigned int> xBegin, xEnd, yBegin, yEnd;
+
+        // Box filter: average of all covered source pixels, weighting
+        // color by alpha so transparent pixels don't darken the result
+        void x_BoxRow(unsigned int y,
+                      std::vector<unsigned long long> &acc) const {
+            acc.assign(5*w, 0);
+            for (unsigned int sy = yBegin[y];  sy < yEnd[y];  ++sy) {
+                const unsigned int *row = src + (size_t)sy*srcW;
+                for (unsigned int x = 0;  x < w;  ++x) {
+                    unsigned long long *a = &acc[5*x];
+                    for (unsigned int sx = xBegin[x];  sx < xEnd[x];  ++sx) {
+                        unsigned int c = row[sx];
+                        unsigned int alpha = c >> 24;
+                        a[0] += (c & 0xFF) * alpha;
+                        a[1] += ((c >> 8) & 0xFF) * alpha;
+                        a[2] += ((c >> 16) & 0xFF) * alpha;
+                        a[3] += alpha;
+                        ++a[4];
+                    }
+                }
+            }
+            unsigned int *out = dst + (size_t)y*w;
+            for (unsigned int x = 0;  x < w;  ++x) {
+                const unsigned long long *a = &acc[5*x];
+                if (a[3] == 0) {
+                    out[x] = 0; //fully transparent
+                    continue;
+                }
+                unsigned int r = (a[0] + a[3]/2) / a[3];
+                unsigned int g = (a[1] + a[3]/2) / a[3];
+                unsigned int b = (a[2] + a[3]/2) / a[3];
+                unsigned int alpha = (a[3] + a[4]/2) / a[4];
+                out[x] = r | g << 8 | b << 16 | alpha << 24;
+            }
+        }
+        // Nearest neighbor: source pixel at the center of each span
+        void x_NearestRow(unsigned int y) const {
+            const unsigned int *row =
+                src + (size_t)((yBegin[y] + yEnd[y] - 1)/2)*srcW;
+            unsigned int *out = dst + (size_t)y*w;
+            for (unsigned int x = 0;  x < w;  ++x) {
+                out[x] = row[(xBegin[x] + xEnd[x] - 1)/2];
+            }
+        }
+        void Rows(unsigned int y0, unsigned int y1) const {
+            std::vector<unsigned long long> acc;
+            for (unsigned int y = y0;  y < y1;  ++y) {
+                if (box) {
+                    x_BoxRow(y, acc);
+                } else {
+                    x_NearestRow(y);
+                }
+            }
+        }
+    };
+
+    // Downsample the srcW x srcH raster src to w x h (w <= srcW, h <=
+    // srcH) into dst, either by box filter (averaging) or by nearest
+    // neighbor sampling.  Large rasters are split by rows across up to
+    // maxThreads threads (0 for one per core).
+    inline void Downsample(const unsigned int *src, unsigned int srcW,
+                           unsigned int srcH, unsigned int *dst,
+                           unsigned int w, unsigned int h, bool box,
+                           unsigned int maxThreads = 0) {
+        SJob job;
+        job.src = src;
+        job.srcW = srcW;
+        job.dst = dst;
+        job.w = w;
+        job.box = box;
+        x_Spans(srcW, w, job.xBegin, job.xEnd);
+        x_Spans(srcH, h, job.yBegin, job.yEnd);
+
+        // only worth starting threads for a few million source pixels
+        const unsigned long long kPixelsPerThread = 1 << 21;
+        unsigned long long work = box ? (unsigned long long)srcW*srcH :
+            (unsigned long long)w*h;
+        unsigned long long maxJobs = work/kPixelsPerThread;
+        unsigned int nThreads =
+            WORKERS::Count(maxThreads, maxJobs < h ? maxJobs : h);
+        WORKERS::ParallelFor(nThreads, nThreads, [&](unsigned int i) {
+                job.Rows((unsigned long long)i*h/nThreads,
+                         (unsigned long long)(i+1)*h/nThreads);
+            });
+    }
+} //end of RESAMPLE namespace
+
+#endif //RESAMPLE__H
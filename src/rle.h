@@ -0,0 +1,119 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains run-length (BI_RLE8 and BI_RLE4) encoding of
+    palette rasters for EMF bitmaps.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef RLE__H
+#define RLE__H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "palette.h"
+
+namespace RLE {
+    // Append n (< 256) palette indices with bitDepth (4 or 8) bits
+    // each in absolute mode (as single pixel runs if too short for it)
+    inline void x_AppendLiteral(std::string &o, const unsigned char *idx,
+                                unsigned int n, unsigned int bitDepth) {
+        if (n < 3) { //absolute mode needs at least 3 pixels
+            for (unsigned int i = 0;  i < n;  ++i) {
+                o += char(1);
+                o += char(bitDepth == 4 ? idx[i]*0x11 : idx[i]);
+            }
+            return;
+        }
+        o += char(0);
+        o += char(n);
+        unsigned int nBytes = n;
+        if (bitDepth == 4) {
+            nBytes = (n + 1)/2;
+            for (unsigned int i = 0;  i < n;  i += 2) {
+                o += char(idx[i] << 4 | (i+1 < n ? idx[i+1] : 0));
+            }
+        } else {
+            o.append(reinterpret_cast<const char*>(idx), n);
+        }
+        if (nBytes % 2) {
+            o += char(0); //absolute runs are padded to 16 bits
+        }
+    }
+
+    // Append the encoding of one row of n palette indices (one per
+    // byte) with bitDepth (4 or 8) bits each
+    inline void x_AppendRow(std::string &o, const unsigned char *idx,
+                            unsigned int n, unsigned int bitDepth) {
+        unsigned int litStart = 0; //pixels not yet written
+        for (unsigned int i = 0;  i < n;  ) {
+            unsigned int r = 1;
+            while (i + r < n  &&  r < 255  &&  idx[i+r] == idx[i]) {
+                ++r;
+            }
+            if (r >= 3) { //worth ending any absolute run for
+                for (;  litStart < i;  litStart += 255) {
+                    x_AppendLiteral(o, idx + litStart,
+                                    std::min(255u, i - litStart), bitDepth);
+                }
+                o += char(r);
+                o += char(bitDepth == 4 ? idx[i]*0x11 : idx[i]);
+                litStart = i + r;
+            }
+            i += r;
+        }
+        for (;  litStart < n;  litStart += 255) {
+            x_AppendLiteral(o, idx + litStart, std::min(255u, n - litStart),
+                            bitDepth);
+        }
+    }
+
+    // Encode the w x h R raster data (rows from the top) as a
+    // bottom-up BI_RLE8 (bitDepth 8) or BI_RLE4 (bitDepth 4) bitmap
+    // with colors indexed by pal, into o.  Returns false (as soon as
+    // known) if the encoding would exceed maxSize bytes.
+    inline bool Encode(std::string &o, const CPalette &pal,
+                       const unsigned int *data, unsigned int w,
+                       unsigned int h, unsigned int bitDepth,
+                       size_t maxSize) {
+        o.clear();
+        std::vector<unsigned char> idx(w);
+        for (unsigned int y = h;  y-- > 0;  ) { //RLE bitmaps are bottom-up
+            pal.PackRow(data + (size_t)y*w, w, 8, &idx[0]);
+            x_AppendRow(o, &idx[0], w, bitDepth);
+            o += char(0);
+            o += char(y > 0 ? 0 : 1); //end of line or of bitmap
+            if (o.size() > maxSize) {
+                o.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+} //end of RLE namespace
+
+#endif //RLE__H
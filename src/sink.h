@@ -0,0 +1,829 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+
+    This header contains the stream buffers (sinks) that metafile
+    output can be written to besides a plain file (memory, a memory
+    mapped file, a file written with direct I/O, and forward-only
+    destinations such as pipes), a buffer handing output to a
+    background writer thread, and one hashing the output on its way
+    through.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef SINK__H
+#define SINK__H
+
+#include <string>
+#include <vector>
+#include <streambuf>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <system_error>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <pthread.h>
+#endif
+#if defined(__unix__)  ||  defined(__APPLE__)
+#define SINK_MMAP
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef O_DIRECT
+#define SINK_DIRECT
+#include <stdlib.h>
+#endif
+#endif
+
+#include "hash.h"
+
+namespace SINK {
+    // Growable in-memory output (seekable, so sizes can be patched in
+    // place as with a file)
+    class CMemBuf : public std::streambuf {
+    public:
+        CMemBuf(void) : m_Pos(0) {}
+        const std::vector<char>& Data(void) const { return m_Data; }
+        void Clear(void) {
+            std::vector<char>().swap(m_Data);
+            m_Pos = 0;
+        }
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            if (n <= 0) {
+                return 0;
+            }
+            if (m_Pos + n > m_Data.size()) {
+                m_Data.resize(m_Pos + n);
+            }
+            memcpy(&m_Data[m_Pos], s, n);
+            m_Pos += n;
+            return n;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                xsputn(&ch, 1);
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            off_type base = dir == std::ios_base::beg ? 0 :
+                (dir == std::ios_base::cur ? m_Pos : m_Data.size());
+            return seekpos(base + off, which);
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            off_type p = pos;
+            if (!(which & std::ios_base::out)  ||  p < 0  ||
+                p > (off_type) m_Data.size()) {
+                return pos_type(off_type(-1));
+            }
+            m_Pos = p;
+            return pos;
+        }
+    private:
+        std::vector<char> m_Data;
+        size_t m_Pos;
+    };
+
+#ifdef SINK_MMAP
+    // File output copied straight into a shared memory mapping of the
+    // file rather than written piece by piece.  The file is grown in
+    // large extents, whose disk space is reserved up front where
+    // possible (so a full disk fails a write rather than raising
+    // SIGBUS), and truncated to the data written by Finish().
+    class CMapBuf : public std::streambuf {
+    public:
+        CMapBuf(void) : m_Fd(-1), m_Ok(true), m_Map(NULL), m_Capacity(0),
+                        m_Pos(0), m_End(0) {}
+        ~CMapBuf(void) { Finish(); }
+        bool Open(const char *filename) {
+            m_Fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            m_Ok = m_Fd >= 0;
+            return m_Ok;
+        }
+        bool IsOpen(void) const { return m_Fd >= 0; }
+        // Unmap and truncate the file.  Returns false if anything
+        // failed.
+        bool Finish(void) {
+            if (m_Fd < 0) {
+                return m_Ok;
+            }
+            if (m_Map  &&  munmap(m_Map, m_Capacity) != 0) {
+                m_Ok = false;
+            }
+            m_Map = NULL;
+            m_Capacity = 0;
+            if (ftruncate(m_Fd, m_End) != 0  ||  ::close(m_Fd) != 0) {
+                m_Ok = false;
+            }
+            m_Fd = -1;
+            return m_Ok;
+        }
+
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            if (n <= 0  ||  !m_Ok  ||
+                (m_Pos + n > m_Capacity  &&  !x_Grow(m_Pos + n))) {
+                return 0;
+            }
+            memcpy(m_Map + m_Pos, s, n);
+            m_Pos += n;
+            m_End = std::max(m_End, m_Pos);
+            return n;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                if (xsputn(&ch, 1) != 1) {
+                    return traits_type::eof();
+                }
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            off_type base = dir == std::ios_base::beg ? 0 :
+                (dir == std::ios_base::cur ? m_Pos : m_End);
+            return seekpos(base + off, which);
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            off_type p = pos;
+            if (!(which & std::ios_base::out)  ||  p < 0  ||
+                p > (off_type) m_End) {
+                return pos_type(off_type(-1));
+            }
+            m_Pos = p;
+            return pos;
+        }
+
+    private:
+        enum { kExtent = 1 << 24 };
+
+        // grow the file and mapping to hold at least size bytes
+        bool x_Grow(size_t size) {
+            size_t capacity = m_Capacity +
+                std::max((size_t)kExtent, m_Capacity/2);
+            capacity = std::max(capacity, size);
+            if (ftruncate(m_Fd, capacity) != 0) {
+                m_Ok = false;
+                return false;
+            }
+#ifdef __linux__
+            if (posix_fallocate(m_Fd, m_Capacity,
+                                capacity - m_Capacity) != 0) {
+                m_Ok = false;
+                return false;
+            }
+#endif
+            void *map;
+#ifdef MREMAP_MAYMOVE
+            map = m_Map ? mremap(m_Map, m_Capacity, capacity, MREMAP_MAYMOVE) :
+                mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m_Fd, 0);
+#else
+            if (m_Map) {
+                munmap(m_Map, m_Capacity);
+                m_Map = NULL;
+                m_Capacity = 0;
+            }
+            map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       m_Fd, 0);
+#endif
+            if (map == MAP_FAILED) {
+                m_Ok = false; //any old mapping is still to be unmapped
+                return false;
+            }
+            m_Map = static_cast<char*>(map);
+            m_Capacity = capacity;
+            return true;
+        }
+
+        int m_Fd;
+        bool m_Ok;
+        char *m_Map;
+        size_t m_Capacity; //of the file and mapping
+        size_t m_Pos, m_End;
+    };
+#endif //SINK_MMAP
+
+#ifdef SINK_DIRECT
+    // File output bypassing the page cache (O_DIRECT), for very large
+    // output to fast local disks.  Data is written in aligned blocks
+    // of the given size (rounded up to a multiple of kAlign); the
+    // final block is padded, and the padding cut off by Finish().
+    // Only the first block, which is kept in memory until Finish(), can
+    // be patched by seeking back.
+    class CDirectBuf : public std::streambuf {
+    public:
+        enum { kAlign = 4096 };
+
+        CDirectBuf(void) : m_Fd(-1), m_Ok(true), m_BlockSize(0),
+                           m_First(NULL), m_Block(NULL), m_Pos(0),
+                           m_End(0) {}
+        ~CDirectBuf(void) {
+            Finish();
+            free(m_First);
+            free(m_Block);
+        }
+        // Returns false if the file cannot be opened for direct I/O
+        // (not all file systems support it)
+        bool Open(const char *filename, size_t blockSize) {
+            m_BlockSize = std::max((size_t) kAlign,
+                                   (blockSize + kAlign-1) / kAlign * kAlign);
+            void *first, *block;
+            if (posix_memalign(&first, kAlign, m_BlockSize) != 0) {
+                return false;
+            }
+            m_First = static_cast<char*>(first);
+            if (posix_memalign(&block, kAlign, m_BlockSize) != 0) {
+                return false;
+            }
+            m_Block = static_cast<char*>(block);
+            m_Fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+                          0666);
+            m_Ok = m_Fd >= 0;
+            return m_Ok;
+        }
+        bool IsOpen(void) const { return m_Fd >= 0; }
+        // Write the last and first blocks, and cut the file to the data
+        // written.  Returns false if anything failed.
+        bool Finish(void) {
+            if (m_Fd < 0) {
+                return m_Ok;
+            }
+            if (m_End > m_BlockSize  &&  m_End % m_BlockSize != 0) {
+                x_Write(m_Block, m_End % m_BlockSize,
+                        m_End - m_End % m_BlockSize);
+            }
+            x_Write(m_First, std::min(m_End, m_BlockSize), 0);
+            if (ftruncate(m_Fd, m_End) != 0  ||  ::close(m_Fd) != 0) {
+                m_Ok = false;
+            }
+            m_Fd = -1;
+            return m_Ok;
+        }
+
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            if (!m_Ok  ||  n <= 0) {
+                return 0;
+            }
+            if (m_Pos < m_End  &&  !x_Patchable(m_Pos, n)) {
+                return 0; //patch would run into data already written
+            }
+            for (std::streamsize done = 0;  done < n; ) {
+                size_t k;
+                if (m_Pos < m_BlockSize) {
+                    k = std::min((size_t)(n - done), m_BlockSize - m_Pos);
+                    memcpy(m_First + m_Pos, s + done, k);
+                } else {
+                    size_t off = m_Pos % m_BlockSize;
+                    k = std::min((size_t)(n - done), m_BlockSize - off);
+                    memcpy(m_Block + off, s + done, k);
+                    if (off + k == m_BlockSize  &&
+                        !x_Write(m_Block, m_BlockSize, m_Pos - off)) {
+                        return done;
+                    }
+                }
+                done += k;
+                m_Pos += k;
+                m_End = std::max(m_End, m_Pos);
+            }
+            return n;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                if (xsputn(&ch, 1) != 1) {
+                    return traits_type::eof();
+                }
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            off_type base = dir == std::ios_base::beg ? 0 :
+                (dir == std::ios_base::cur ? m_Pos : m_End);
+            return seekpos(base + off, which);
+        }
+        // only the first block (while in memory) and the end of the
+        // output can be sought; writes there must stay within the
+        // first block or the data not yet written out (see
+        // x_Patchable())
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            off_type p = pos;
+            if (!(which & std::ios_base::out)  ||  p < 0  ||
+                (p != (off_type) m_End  &&  !x_Patchable(p, 1))) {
+                return pos_type(off_type(-1));
+            }
+            m_Pos = p;
+            return pos;
+        }
+
+    private:
+        // whether n bytes at pos (before the end) are still in memory:
+        // in the first block, or anywhere if nothing has gone past it
+        bool x_Patchable(size_t pos, size_t n) const {
+            return pos + n <= m_BlockSize  ||  m_End <= m_BlockSize;
+        }
+        // write n bytes (padded to kAlign) of block at file offset pos
+        bool x_Write(char *block, size_t n, size_t pos) {
+            size_t padded = (n + kAlign-1) / kAlign * kAlign;
+            memset(block + n, 0, padded - n);
+            for (size_t done = 0;  done < padded; ) {
+                ssize_t k = pwrite(m_Fd, block + done, padded - done,
+                                   pos + done);
+                if (k <= 0) {
+                    m_Ok = false;
+                    return false;
+                }
+                done += k;
+            }
+            return true;
+        }
+
+        int m_Fd;
+        bool m_Ok;
+        size_t m_BlockSize;
+        char *m_First; //first block (kept to be patched)
+        char *m_Block; //block being filled
+        size_t m_Pos, m_End;
+    };
+#endif //SINK_DIRECT
+
+    // Passes output on to dest, hashing what is appended to it after
+    // Start() (patches of earlier output, by seeking back, are not
+    // hashed).  The stream is hashed in blocks of fixed size, so the
+    // hash does not depend on how the output was written.
+    class CHashBuf : public std::streambuf {
+    public:
+        CHashBuf(std::streambuf *dest, HASH::TUInt8 seed) :
+            m_Dest(dest), m_Hash(seed), m_Hashing(false), m_Pos(0),
+            m_End(0) {}
+        void Start(void) { m_Hashing = true; }
+        // hash of the output since Start(), once all is written
+        HASH::TUInt8 Hash(void) {
+            if (!m_Block.empty()) {
+                m_Hash = HASH::Hash64(m_Block.data(), m_Block.size(), m_Hash);
+                m_Block.clear();
+            }
+            return m_Hash;
+        }
+
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            n = m_Dest->sputn(s, n);
+            if (n > 0  &&  m_Hashing  &&  m_Pos == m_End) {
+                x_Hash(s, n);
+            }
+            m_Pos += std::max(n, (std::streamsize) 0);
+            m_End = std::max(m_End, m_Pos);
+            return n;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                if (xsputn(&ch, 1) != 1) {
+                    return traits_type::eof();
+                }
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            return x_Moved(m_Dest->pubseekoff(off, dir, which));
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            return x_Moved(m_Dest->pubseekpos(pos, which));
+        }
+        int sync(void) { return m_Dest->pubsync(); }
+
+    private:
+        enum { kBlockSize = 1 << 16 };
+
+        void x_Hash(const char *s, size_t n) {
+            while (n > 0) {
+                if (m_Block.empty()  &&  n >= kBlockSize) {
+                    m_Hash = HASH::Hash64(s, kBlockSize, m_Hash);
+                    s += kBlockSize;
+                    n -= kBlockSize;
+                    continue;
+                }
+                size_t k = std::min(n, kBlockSize - m_Block.size());
+                m_Block.insert(m_Block.end(), s, s + k);
+                s += k;
+                n -= k;
+                if (m_Block.size() == kBlockSize) {
+                    m_Hash = HASH::Hash64(m_Block.data(), kBlockSize, m_Hash);
+                    m_Block.clear();
+                }
+            }
+        }
+        pos_type x_Moved(pos_type pos) {
+            if (pos != pos_type(off_type(-1))) {
+                m_Pos = off_type(pos);
+            }
+            return pos;
+        }
+
+        std::streambuf *m_Dest;
+        HASH::TUInt8 m_Hash;
+        bool m_Hashing;
+        std::vector<char> m_Block; //partial block not yet hashed
+        unsigned long long m_Pos, m_End;
+    };
+
+    // Output that is only appended to, apart from its head (the bytes
+    // written before EndHead()), which may be overwritten by seeking
+    // back until Finish().  Subclasses take the appended data.
+    class CHeadBuf : public std::streambuf {
+    public:
+        CHeadBuf(void) : m_Ok(true), m_InHead(true), m_Pos(0), m_End(0) {}
+        virtual ~CHeadBuf(void) {}
+        void EndHead(void) {
+            if (m_InHead) {
+                m_InHead = false;
+                x_HeadDone();
+            }
+        }
+        // Write out whatever is pending.  Returns false if anything
+        // failed.
+        virtual bool Finish(void) = 0;
+
+    protected:
+        virtual void x_HeadDone(void) {}
+        virtual void x_Append(const char *s, size_t n) = 0;
+        const std::string& x_Head(void) const { return m_Head; }
+        unsigned long long x_Size(void) const { return m_End; }
+
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            if (n <= 0  ||  !m_Ok) {
+                return 0;
+            }
+            if (m_Pos < m_Head.size()  ||  m_InHead) {
+                if (m_Pos + n > m_Head.size()) {
+                    if (!m_InHead) {
+                        return 0; //patch may not run past the head
+                    }
+                    m_Head.resize(m_Pos + n);
+                    m_End = m_Head.size();
+                }
+                std::copy(s, s + n, m_Head.begin() + m_Pos);
+            } else if (m_Pos == m_End) {
+                m_End += n;
+                x_Append(s, n);
+            } else {
+                return 0; //data already passed on cannot be changed
+            }
+            m_Pos += n;
+            return m_Ok ? n : 0;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                if (xsputn(&ch, 1) != 1) {
+                    return traits_type::eof();
+                }
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            off_type base = dir == std::ios_base::beg ? 0 :
+                (dir == std::ios_base::cur ? m_Pos : m_End);
+            return seekpos(base + off, which);
+        }
+        // only the head and the end of the output can be sought
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            off_type p = pos;
+            if (!(which & std::ios_base::out)  ||  p < 0  ||
+                (p > (off_type) m_Head.size()  &&  p != (off_type) m_End)) {
+                return pos_type(off_type(-1));
+            }
+            m_Pos = p;
+            return pos;
+        }
+
+        bool m_Ok;
+    private:
+        bool m_InHead;
+        std::string m_Head;
+        unsigned long long m_Pos, m_End;
+    };
+
+    // Output passed on to dest by a background thread, so the R thread
+    // does not wait for slow storage.  Data is handed over in blocks,
+    // of which at most kMaxQueued wait at any time (further writes
+    // block until the writer catches up).  Data already handed over
+    // may still be overwritten by seeking back; such patches are
+    // queued and applied by the writer in order.
+    class CAsyncBuf : public std::streambuf {
+    public:
+        CAsyncBuf(std::streambuf *dest) :
+            m_Dest(dest), m_Ok(true), m_Stop(false), m_Queued(0),
+            m_BlockStart(0), m_Pos(0), m_End(0) {
+            m_DestStart = m_Dest->pubseekoff(0, std::ios_base::cur,
+                                             std::ios_base::out);
+            try {
+                m_Thread = std::thread(&CAsyncBuf::x_Run, this);
+            } catch (const std::system_error &) {
+                // no thread to be had; write synchronously instead
+            }
+        }
+        ~CAsyncBuf(void) { Finish(); }
+        std::streambuf* Dest(void) const { return m_Dest; }
+
+        // Hand over all data and wait until it is written
+        bool Drain(void) {
+            x_Submit();
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Cond.wait(lock, [this]() { return m_Queued == 0; });
+            return m_Ok;
+        }
+        // As Drain, also stopping the writer.  Returns false if any
+        // write failed.
+        bool Finish(void) {
+            Drain();
+            if (m_Thread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_Stop = true;
+                }
+                m_Cond.notify_all();
+                m_Thread.join();
+            }
+            return m_Ok;
+        }
+
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) {
+            if (n <= 0  ||  !m_Ok) {
+                return 0;
+            }
+            const char *p = s;
+            size_t left = n;
+            if (m_Pos < m_BlockStart) { //patch of data handed over
+                size_t len = std::min((unsigned long long)left,
+                                      m_BlockStart - m_Pos);
+                SItem patch(m_Pos, std::string(p, len));
+                x_Queue(patch);
+                m_Pos += len;
+                p += len;
+                left -= len;
+            }
+            if (left > 0) {
+                size_t at = m_Pos - m_BlockStart;
+                if (at + left > m_Block.size()) {
+                    m_Block.resize(at + left);
+                }
+                memcpy(&m_Block[at], p, left);
+                m_Pos += left;
+                m_End = std::max(m_End, m_Pos);
+                if (m_Block.size() >= kBlockSize) {
+                    x_Submit();
+                }
+            }
+            return m_Ok ? n : 0;
+        }
+        int_type overflow(int_type c) {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                char ch = traits_type::to_char_type(c);
+                if (xsputn(&ch, 1) != 1) {
+                    return traits_type::eof();
+                }
+            }
+            return traits_type::not_eof(c);
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) {
+            off_type base = dir == std::ios_base::beg ? 0 :
+                (dir == std::ios_base::cur ? m_Pos : m_End);
+            return seekpos(base + off, which);
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            off_type p = pos;
+            if (!(which & std::ios_base::out)  ||  p < 0  ||
+                p > (off_type) m_End) {
+                return pos_type(off_type(-1));
+            }
+            m_Pos = p;
+            return pos;
+        }
+        int sync(void) {
+            return Drain()  &&  m_Dest->pubsync() == 0 ? 0 : -1;
+        }
+
+    private:
+        enum { kBlockSize = 1 << 20, kMaxQueued = 8 };
+
+        struct SItem {
+            unsigned long long offset;
+            std::string data;
+            bool patch;
+            SItem(unsigned long long o, const std::string &d, bool p = true) :
+                offset(o), data(d), patch(p) {}
+        };
+
+        void x_Submit(void) {
+            if (m_Block.empty()) {
+                return;
+            }
+            SItem item(m_BlockStart, std::string(), false);
+            item.data.swap(m_Block);
+            m_BlockStart += item.data.size();
+            x_Queue(item);
+        }
+        void x_Queue(SItem &item) {
+            if (!m_Thread.joinable()) {
+                x_Write(item);
+                return;
+            }
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Cond.wait(lock, [this]() {
+                    return m_Queued < kMaxQueued*(size_t)kBlockSize;
+                });
+            m_Queued += item.data.size() + 1;
+            m_Items.push_back(std::move(item));
+            lock.unlock();
+            m_Cond.notify_all();
+        }
+        void x_Write(const SItem &item) {
+            if (!m_Ok) {
+                return;
+            }
+            const std::streamsize n = item.data.size();
+            if (!item.patch) {
+                m_Ok = m_Dest->sputn(item.data.data(), n) == n;
+            } else if (m_DestStart == std::streampos(-1)  ||
+                       m_Dest->pubseekpos(m_DestStart +
+                                          std::streamoff(item.offset),
+                                          std::ios_base::out) ==
+                       std::streampos(-1)) {
+                m_Ok = false;
+            } else {
+                m_Ok = m_Dest->sputn(item.data.data(), n) == n  &&
+                    m_Dest->pubseekoff(0, std::ios_base::end,
+                                       std::ios_base::out) !=
+                    std::streampos(-1);
+            }
+        }
+        // writer thread
+        void x_Run(void) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            while (true) {
+                m_Cond.wait(lock, [this]() {
+                        return m_Stop  ||  !m_Items.empty();
+                    });
+                if (m_Items.empty()) {
+                    return; //stopped
+                }
+                SItem item = std::move(m_Items.front());
+                m_Items.pop_front();
+                lock.unlock();
+                x_Write(item);
+                lock.lock();
+                m_Queued -= item.data.size() + 1;
+                m_Cond.notify_all();
+            }
+        }
+
+        std::streambuf *m_Dest;
+        std::streampos m_DestStart;
+        std::atomic<bool> m_Ok;
+        std::thread m_Thread;
+        std::mutex m_Mutex;
+        std::condition_variable m_Cond;
+        bool m_Stop;
+        std::deque<SItem> m_Items;
+        size_t m_Queued; //bytes (+1 per item) handed over but not written
+        std::string m_Block; //data not yet handed over
+        unsigned long long m_BlockStart, m_Pos, m_End;
+    };
+
+#ifndef _WIN32
+    // Blocks SIGPIPE for the calling thread while in scope, so that a
+    // command exiting early fails the write (EPIPE) rather than
+    // killing R.  Any SIGPIPE raised meanwhile is taken off before the
+    // old mask is restored, unless one was pending already.
+    class CNoSigPipe {
+    public:
+        CNoSigPipe(void) {
+            sigemptyset(&m_Set);
+            sigaddset(&m_Set, SIGPIPE);
+            m_WasPending = x_Pending();
+            pthread_sigmask(SIG_BLOCK, &m_Set, &m_Old);
+        }
+        ~CNoSigPipe(void) {
+            int sig;
+            if (!m_WasPending  &&  x_Pending()) {
+                sigwait(&m_Set, &sig); //returns at once, as it is pending
+            }
+            pthread_sigmask(SIG_SETMASK, &m_Old, NULL);
+        }
+    private:
+        static bool x_Pending(void) {
+            sigset_t pending;
+            return sigpending(&pending) == 0  &&
+                sigismember(&pending, SIGPIPE) == 1;
+        }
+        sigset_t m_Set, m_Old;
+        bool m_WasPending;
+    };
+#endif
+
+    // Output to the standard input of a shell command.  A pipe cannot
+    // seek, yet the head must be sent first and is only final at the
+    // end, so the rest is kept in memory and everything is sent by
+    // Finish().
+    class CPipeBuf : public CHeadBuf {
+    public:
+        CPipeBuf(const char *command) {
+#ifdef _WIN32
+            m_Pipe = _popen(command, "wb");
+#else
+            m_Pipe = popen(command, "w");
+#endif
+        }
+        ~CPipeBuf(void) {
+            if (m_Pipe) {
+                x_Close();
+            }
+        }
+        bool IsOpen(void) const { return m_Pipe != NULL; }
+
+        bool Finish(void) {
+            EndHead();
+            if (!IsOpen()) {
+                return false;
+            }
+            x_Send(x_Head());
+            x_Send(m_Body);
+            std::string().swap(m_Body);
+            if (x_Close() != 0) {
+                m_Ok = false; //command failed
+            }
+            return m_Ok;
+        }
+
+    protected:
+        void x_Append(const char *s, size_t n) { m_Body.append(s, n); }
+    private:
+        void x_Send(const std::string &data) {
+            if (!m_Ok  ||  data.empty()) {
+                return;
+            }
+#ifndef _WIN32
+            CNoSigPipe noSigPipe;
+#endif
+            if (fwrite(data.data(), 1, data.size(), m_Pipe) != data.size()) {
+                m_Ok = false;
+            }
+        }
+        int x_Close(void) {
+            FILE *pipe = m_Pipe;
+            m_Pipe = NULL;
+#ifndef _WIN32
+            CNoSigPipe noSigPipe;
+            return pclose(pipe);
+#else
+            return _pclose(pipe);
+#endif
+        }
+
+        FILE *m_Pipe;
+        std::string m_Body; //output after the head
+    };
+} //end of SINK namespace
+
+#endif //SINK__H
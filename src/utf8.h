@@ -0,0 +1,178 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains a validating UTF-8 decoder used for all text
+    (EMF/EMF+ strings are UTF-16LE; font metrics are keyed by code
+    point).  Runs of ASCII are widened 16 bytes at a time when SSE2 is
+    available.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef UTF8__H
+#define UTF8__H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+#if defined(__SSE2__)  ||  defined(_M_X64)
+#define UTF8_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace UTF8 {
+    // Decode the code point starting at p (p < end) and advance p past
+    // it.  Returns false for malformed input: stray continuation bytes,
+    // truncated or overlong sequences, surrogates and values > U+10FFFF.
+    inline bool Next(const unsigned char *&p, const unsigned char *end,
+                     unsigned int &cp) {
+        unsigned int c = *p++;
+        if (c < 0x80) {
+            cp = c;
+            return true;
+        }
+        unsigned int nTrail, min;
+        if (c < 0xC2) {
+            return false;
+        } else if (c < 0xE0) {
+            nTrail = 1; min = 0x80; cp = c & 0x1F;
+        } else if (c < 0xF0) {
+            nTrail = 2; min = 0x800; cp = c & 0x0F;
+        } else if (c < 0xF5) {
+            nTrail = 3; min = 0x10000; cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if ((size_t)(end - p) < nTrail) {
+            return false;
+        }
+        for (unsigned int i = 0;  i < nTrail;  ++i, ++p) {
+            if ((*p & 0xC0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (*p & 0x3F);
+        }
+        return cp >= min  &&  cp <= 0x10FFFF  &&  (cp < 0xD800 || cp > 0xDFFF);
+    }
+
+    // Append the UTF-16LE encoding of str (len bytes of UTF-8) to out.
+    // On invalid input, out is left unchanged and false is returned.
+    inline bool AppendUTF16LE(std::string &out, const char *str, size_t len) {
+        size_t start = out.size();
+        out.resize(start + 2*len); //never more than one unit per byte
+        unsigned char *begin = reinterpret_cast<unsigned char*>(&out[0]);
+        unsigned char *o = begin + start;
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(str);
+        const unsigned char *end = p + len;
+#ifdef UTF8_SSE2
+        const __m128i zero = _mm_setzero_si128();
+#endif
+        while (p < end) {
+#ifdef UTF8_SSE2
+            while (end - p >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*) p);
+                if (_mm_movemask_epi8(v) != 0) {
+                    break; //non-ASCII byte somewhere in this block
+                }
+                _mm_storeu_si128((__m128i*) o, _mm_unpacklo_epi8(v, zero));
+                _mm_storeu_si128((__m128i*) (o+16), _mm_unpackhi_epi8(v, zero));
+                p += 16;
+                o += 32;
+            }
+            if (p == end) {
+                break;
+            }
+#endif
+            if (*p < 0x80) {
+                o[0] = *p++;
+                o[1] = 0;
+                o += 2;
+                continue;
+            }
+            unsigned int cp;
+            if (!Next(p, end, cp)) {
+                out.resize(start);
+                return false;
+            }
+            if (cp >= 0x10000) { //surrogate pair
+                cp -= 0x10000;
+                unsigned int hi = 0xD800 + (cp >> 10);
+                unsigned int lo = 0xDC00 + (cp & 0x3FF);
+                o[0] = hi & 0xFF; o[1] = hi >> 8;
+                o[2] = lo & 0xFF; o[3] = lo >> 8;
+                o += 4;
+            } else {
+                o[0] = cp & 0xFF; o[1] = cp >> 8;
+                o += 2;
+            }
+        }
+        out.resize(o - begin);
+        return true;
+    }
+
+    // Append the code points of str (len bytes of UTF-8) to out.  On
+    // invalid input, out is left unchanged and false is returned.
+    inline bool AppendCodepoints(std::vector<unsigned int> &out,
+                                 const char *str, size_t len) {
+        size_t start = out.size();
+        out.resize(start + len); //never more than one code point per byte
+        unsigned int *o = out.data() + start;
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(str);
+        const unsigned char *end = p + len;
+#ifdef UTF8_SSE2
+        const __m128i zero = _mm_setzero_si128();
+#endif
+        while (p < end) {
+#ifdef UTF8_SSE2
+            while (end - p >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*) p);
+                if (_mm_movemask_epi8(v) != 0) {
+                    break;
+                }
+                __m128i lo = _mm_unpacklo_epi8(v, zero);
+                __m128i hi = _mm_unpackhi_epi8(v, zero);
+                _mm_storeu_si128((__m128i*) o, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*) (o+4), _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*) (o+8), _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i*) (o+12), _mm_unpackhi_epi16(hi, zero));
+                p += 16;
+                o += 16;
+            }
+            if (p == end) {
+                break;
+            }
+#endif
+            if (!Next(p, end, *o)) {
+                out.resize(start);
+                return false;
+            }
+            ++o;
+        }
+        out.resize(o - out.data());
+        return true;
+    }
+} //end of UTF8 namespace
+
+#endif //UTF8__H
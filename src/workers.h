@@ -0,0 +1,83 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains a minimal worker pool for splitting CPU-heavy
+    raster work (e.g., downsampling and compression) across threads.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef WORKERS__H
+#define WORKERS__H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <system_error>
+
+namespace WORKERS {
+    // Number of threads to use for nJobs independent jobs, given the
+    // requested maximum (0 meaning one per available core)
+    inline unsigned int Count(unsigned int maxThreads,
+                              unsigned long long nJobs) {
+        unsigned int n = maxThreads;
+        if (n == 0) {
+            n = std::thread::hardware_concurrency(); //0 if unknown
+        }
+        if (n > nJobs) {
+            n = nJobs;
+        }
+        return n > 0 ? n : 1;
+    }
+
+    // Run job(i) for each i in [0, nJobs) on up to nThreads threads
+    // (including the calling one), which take jobs in order as they
+    // become free.  job must be safe to call concurrently for
+    // different i.
+    template<class TJob>
+    void ParallelFor(unsigned int nJobs, unsigned int nThreads,
+                     const TJob &job) {
+        std::atomic<unsigned int> next(0);
+        auto work = [&]() {
+            for (unsigned int i = next++;  i < nJobs;  i = next++) {
+                job(i);
+            }
+        };
+        std::vector<std::thread> threads;
+        try {
+            while (threads.size() + 1 < nThreads  &&
+                   threads.size() + 1 < nJobs) {
+                threads.push_back(std::thread(work));
+            }
+        } catch (const std::system_error &) {
+            // out of threads; remaining jobs are done by the others
+        }
+        work();
+        for (unsigned int i = 0;  i < threads.size();  ++i) {
+            threads[i].join();
+        }
+    }
+} //end of WORKERS namespace
+
+#endif //WORKERS__H